@@ -0,0 +1,256 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include "ConvolutionEngine.h"
+
+/**
+    the measured best engine configuration for each combination of partition size and
+    impulse response shape, persisted in the user's application data folder so the
+    measurements only have to be made once per machine, much like FFTW's wisdom.
+
+    shared between all Convolution instances through a juce::SharedResourcePointer.
+*/
+class ConvolutionWisdom
+{
+public:
+    ConvolutionWisdom()
+    {
+        juce::PropertiesFile::Options options;
+        options.applicationName = "Convolution";
+        options.folderName = "Convolution";
+        options.filenameSuffix = ".wisdom";
+        options.osxLibrarySubFolder = "Application Support";
+        options.storageFormat = juce::PropertiesFile::storeAsXML;
+        wisdomFile = std::make_unique<juce::PropertiesFile>(options);
+    }
+
+    /**
+        the cost of each engine depends on the block size, the length of the response
+        and, for sparse responses, on how many taps have to be convolved directly. the
+        sample rate of the device sets how long a block may take.
+    */
+    static juce::String getKey(const ImpulseResponse& impulseResponse, int partitionSize, double sampleRate)
+    {
+        // the version is bumped whenever the selection rule changes, so older measurements are redone
+        return "v3_rate" + juce::String(juce::roundToInt(sampleRate))
+             + "_block" + juce::String(partitionSize)
+             + "_length" + juce::String(impulseResponse.getLength())
+             + "_taps" + juce::String(impulseResponse.isSparse() ? impulseResponse.getNumDirectTaps() : 0);
+    }
+
+    bool contains(const juce::String& key) const
+    {
+        return wisdomFile->containsKey(key);
+    }
+
+    // the measured winner, or the default configuration when nothing has been measured yet
+    EngineConfiguration getConfiguration(const ImpulseResponse& impulseResponse, int partitionSize, double sampleRate) const
+    {
+        const auto key = getKey(impulseResponse, partitionSize, sampleRate);
+
+        if(! contains(key))
+            return EngineConfiguration::getDefault(impulseResponse);
+
+        return EngineConfiguration::fromString(wisdomFile->getValue(key));
+    }
+
+    void store(const juce::String& key, const EngineConfiguration& configuration)
+    {
+        wisdomFile->setValue(key, configuration.toString());
+        wisdomFile->saveIfNeeded();
+    }
+
+private:
+    std::unique_ptr<juce::PropertiesFile> wisdomFile;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (ConvolutionWisdom)
+};
+
+/**
+    times every candidate engine configuration for an impulse response on this CPU and
+    stores the fastest in the ConvolutionWisdom.
+
+    the benchmarks run on a background thread, so loading an impulse response for the
+    first time never blocks the message thread or the audio callback.
+*/
+class ConvolutionAutotuner
+{
+public:
+    ConvolutionAutotuner() = default;
+
+    ~ConvolutionAutotuner()
+    {
+        tuningPool.removeAllJobs(true, 10000);
+    }
+
+    /**
+        benchmarks the engines for impulseResponse at partitionSize on a device running at
+        sampleRate, unless the wisdom already knows the answer. onTuned is called on the message thread with the winner, only if
+        a benchmark actually ran.
+    */
+    void tuneInBackground(ImpulseResponse::Ptr impulseResponse, int partitionSize, double sampleRate,
+                          std::function<void(const EngineConfiguration&)> onTuned)
+    {
+        if(impulseResponse == nullptr || sampleRate <= 0.0
+           || wisdom->contains(ConvolutionWisdom::getKey(*impulseResponse, partitionSize, sampleRate)))
+            return;
+
+        tuningPool.addJob([impulseResponse, partitionSize, sampleRate, onTuned]
+        {
+            juce::SharedResourcePointer<ConvolutionWisdom> sharedWisdom;
+            const auto key = ConvolutionWisdom::getKey(*impulseResponse, partitionSize, sampleRate);
+
+            // the same response may have been queued twice before the first run finished
+            if(sharedWisdom->contains(key))
+                return;
+
+            const auto winner = findFastestConfiguration(*impulseResponse, partitionSize, sampleRate);
+            sharedWisdom->store(key, winner);
+
+            if(onTuned != nullptr)
+                juce::MessageManager::callAsync([onTuned, winner] { onTuned(winner); });
+        });
+    }
+
+    static juce::Array<EngineConfiguration> getCandidates(const ImpulseResponse& impulseResponse, int partitionSize)
+    {
+        using Type = EngineConfiguration::Type;
+        juce::Array<EngineConfiguration> candidates;
+
+        candidates.add({ Type::uniform, 0 });
+
+        // the direct engine only stands a chance against short responses, so don't waste time timing it on long ones
+        if(impulseResponse.getLength() <= maximumDirectLength)
+            candidates.add({ Type::direct, 0 });
+
+        if(impulseResponse.isSparse())
+            candidates.add({ Type::sparse, 0 });
+
+        for(int maximumPartitionSize = partitionSize * 4; maximumPartitionSize <= maximumNonUniformPartitionSize; maximumPartitionSize *= 4)
+        {
+            // the first larger segment starts at four head partitions, shorter responses never reach it
+            if(impulseResponse.getLength() <= partitionSize * 4)
+                break;
+
+            candidates.add({ Type::nonUniform, maximumPartitionSize });
+        }
+
+        return candidates;
+    }
+
+    /**
+        the engine runs inside the audio callback, so the cheapest average isn't enough: a
+        candidate whose slowest block takes more than maximumBlockLoad of the time that block
+        lasts could miss the deadline, as the non-uniform engine does when all its large FFTs
+        fall into the same block. the cheapest candidate that stays within that budget wins,
+        and if none do, the one with the fastest slowest block.
+
+        the candidates are timed on a private copy of the response, so the segments and
+        spectra built for the losers are freed again instead of staying in the shared caches.
+    */
+    static EngineConfiguration findFastestConfiguration(const ImpulseResponse& impulseResponse, int partitionSize, double sampleRate)
+    {
+        jassert(sampleRate > 0.0);
+        auto candidates = getCandidates(impulseResponse, partitionSize);
+        const auto benchmarkImpulseResponse = impulseResponse.createUncachedCopy();
+        const double blockBudget = maximumBlockLoad * partitionSize / sampleRate;
+
+        auto fastest = candidates.getFirst();
+        double fastestTime = std::numeric_limits<double>::max();
+        auto mostPredictable = candidates.getFirst();
+        double mostPredictableWorstBlock = std::numeric_limits<double>::max();
+
+        for(const auto& candidate : candidates)
+        {
+            const auto timing = measure(*benchmarkImpulseResponse, partitionSize, candidate);
+            DBG("Autotuner: " + candidate.toString() + " takes " + juce::String(timing.secondsPerSample * 1.0e9, 1) + " ns per sample, "
+                + juce::String(timing.worstBlockSeconds / blockBudget * 100.0, 1) + "% of the block budget at worst");
+
+            if(timing.worstBlockSeconds < mostPredictableWorstBlock)
+            {
+                mostPredictableWorstBlock = timing.worstBlockSeconds;
+                mostPredictable = candidate;
+            }
+
+            if(timing.worstBlockSeconds <= blockBudget && timing.secondsPerSample < fastestTime)
+            {
+                fastestTime = timing.secondsPerSample;
+                fastest = candidate;
+            }
+        }
+
+        if(fastestTime == std::numeric_limits<double>::max())
+            fastest = mostPredictable;
+
+        DBG("Autotuner picked " + fastest.toString() + " for " + ConvolutionWisdom::getKey(impulseResponse, partitionSize, sampleRate));
+        return fastest;
+    }
+
+private:
+    struct Timing
+    {
+        double secondsPerSample = 0.0;
+        double worstBlockSeconds = 0.0;
+    };
+
+    /**
+        feeds noise through one channel in whole partitions, the way the block size adapter
+        does. the run is long enough to include the largest FFT of a non-uniform engine
+        twice. the best of a few runs is kept for the average and the best of the runs'
+        slowest blocks for the worst case, both to filter out interruptions.
+    */
+    static Timing measure(const ImpulseResponse& impulseResponse, int partitionSize, const EngineConfiguration& configuration)
+    {
+        auto convolver = createChannelConvolver(impulseResponse, 0, partitionSize, configuration);
+
+        // separate output so the noise never feeds back into itself and runs into denormals
+        AlignedFloatBuffer input(static_cast<size_t>(partitionSize));
+        AlignedFloatBuffer output(static_cast<size_t>(partitionSize));
+        juce::Random random;
+        for(size_t sample = 0; sample < input.getSize(); ++sample)
+            input.get()[sample] = random.nextFloat() * 2.0f - 1.0f;
+
+        const int largestPartition = juce::jmax(partitionSize, configuration.maximumPartitionSize);
+        const int numBlocks = juce::jmax(minimumBlocksPerRun, 2 * largestPartition / partitionSize);
+
+        // the first pass pulls everything into the caches
+        for(int blockIndex = 0; blockIndex < numBlocks; ++blockIndex)
+            convolver->process(input.get(), output.get(), partitionSize);
+
+        double bestTime = std::numeric_limits<double>::max();
+        double bestWorstBlock = std::numeric_limits<double>::max();
+
+        for(int run = 0; run < numRuns; ++run)
+        {
+            double runTime = 0.0, worstBlock = 0.0;
+
+            // every block starts at the same phase in each run, so the slow ones line up across runs
+            for(int blockIndex = 0; blockIndex < numBlocks; ++blockIndex)
+            {
+                const auto startTicks = juce::Time::getHighResolutionTicks();
+                convolver->process(input.get(), output.get(), partitionSize);
+                const auto blockSeconds = juce::Time::highResolutionTicksToSeconds(juce::Time::getHighResolutionTicks() - startTicks);
+
+                runTime += blockSeconds;
+                worstBlock = juce::jmax(worstBlock, blockSeconds);
+            }
+
+            bestTime = juce::jmin(bestTime, runTime);
+            bestWorstBlock = juce::jmin(bestWorstBlock, worstBlock);
+        }
+
+        return { bestTime / (static_cast<double>(numBlocks) * partitionSize), bestWorstBlock };
+    }
+
+    static constexpr int maximumDirectLength = 8192;
+    static constexpr int maximumNonUniformPartitionSize = 32768;
+    static constexpr int minimumBlocksPerRun = 32;
+    static constexpr int numRuns = 3;
+    // share of a block's duration one channel may take, leaving room for the other channels and the rest of the callback
+    static constexpr double maximumBlockLoad = 0.25;
+
+    juce::SharedResourcePointer<ConvolutionWisdom> wisdom;
+    juce::ThreadPool tuningPool { 1 };
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (ConvolutionAutotuner)
+};
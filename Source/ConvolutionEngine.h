@@ -0,0 +1,1020 @@
+#pragma once
+
+#include <JuceHeader.h>
+
+/**
+    float storage aligned to a cache line, so vectorised loads never straddle two lines
+*/
+class AlignedFloatBuffer
+{
+public:
+    static constexpr size_t alignment = 64;
+
+    AlignedFloatBuffer() = default;
+    explicit AlignedFloatBuffer(size_t numberOfFloats) { allocate(numberOfFloats); }
+
+    // the moved-from buffer is left empty, it mustn't keep pointing into the storage it gave away
+    AlignedFloatBuffer(AlignedFloatBuffer&& other) noexcept
+        : storage(std::move(other.storage)),
+          data(std::exchange(other.data, nullptr)),
+          size(std::exchange(other.size, 0))
+    {
+    }
+
+    AlignedFloatBuffer& operator=(AlignedFloatBuffer&& other) noexcept
+    {
+        storage = std::move(other.storage);
+        data = std::exchange(other.data, nullptr);
+        size = std::exchange(other.size, 0);
+        return *this;
+    }
+
+    // allocates zeroed memory, any previous contents are lost
+    void allocate(size_t numberOfFloats)
+    {
+        storage.calloc(numberOfFloats * sizeof(float) + alignment);
+        const auto address = reinterpret_cast<std::uintptr_t>(storage.get());
+        data = reinterpret_cast<float*>((address + alignment - 1) & ~static_cast<std::uintptr_t>(alignment - 1));
+        size = numberOfFloats;
+    }
+
+    void clear()
+    {
+        if(size > 0)
+            juce::FloatVectorOperations::clear(data, static_cast<int>(size));
+    }
+
+    float* get() noexcept { return data; }
+    const float* get() const noexcept { return data; }
+    size_t getSize() const noexcept { return size; }
+
+    // rounds a number of floats up so that consecutive blocks of it stay aligned
+    static size_t roundUpToAlignment(size_t numberOfFloats)
+    {
+        constexpr size_t floatsPerLine = alignment / sizeof(float);
+        return (numberOfFloats + floatsPerLine - 1) / floatsPerLine * floatsPerLine;
+    }
+
+private:
+    juce::HeapBlock<char> storage;
+    float* data = nullptr;
+    size_t size = 0;
+
+    JUCE_DECLARE_NON_COPYABLE (AlignedFloatBuffer)
+};
+
+class ImpulseResponse;
+
+/**
+    the spectra of an impulse response cut into equally sized partitions.
+
+    every partition of partitionSize samples is zero padded to twice its length
+    and transformed once, so a streaming convolver only has to multiply and add
+    spectra. the layout is the one produced by juce::dsp::FFT with only the
+    non-negative frequencies: interleaved real/imaginary pairs, fftSize / 2 + 1 bins.
+*/
+class PartitionedImpulseResponse
+{
+public:
+    PartitionedImpulseResponse(const ImpulseResponse& impulseResponse, int partitionSizeToUse);
+
+    int getPartitionSize() const noexcept { return partitionSize; }
+    int getFFTSize() const noexcept { return partitionSize * 2; }
+    int getNumBins() const noexcept { return partitionSize + 1; }
+    int getNumPartitions() const noexcept { return numPartitions; }
+    int getNumChannels() const noexcept { return numChannels; }
+
+    // number of floats between two spectra, keeps every spectrum cache aligned
+    size_t getSpectrumStride() const noexcept { return spectrumStride; }
+
+    const float* getSpectrum(int channel, int partition) const noexcept
+    {
+        return spectra.get() + (static_cast<size_t>(channel) * static_cast<size_t>(numPartitions) + static_cast<size_t>(partition)) * spectrumStride;
+    }
+
+    // the partitions of a channel that aren't pure silence, in ascending order
+    const juce::Array<int>& getActivePartitions(int channel) const noexcept { return activePartitions.getReference(channel); }
+
+private:
+    float* getSpectrumForWriting(int channel, int partition) noexcept
+    {
+        return const_cast<float*>(getSpectrum(channel, partition));
+    }
+
+    int partitionSize = 0;
+    int numPartitions = 0;
+    int numChannels = 0;
+    size_t spectrumStride = 0;
+    AlignedFloatBuffer spectra;
+    juce::Array<juce::Array<int>> activePartitions;
+
+    JUCE_DECLARE_NON_COPYABLE (PartitionedImpulseResponse)
+};
+
+/**
+    a loaded impulse response that never changes after it has been created.
+
+    it is reference counted so any number of Convolution instances can share the
+    samples and the partition spectra, each of them only keeps its own streaming state.
+
+    when it is loaded the response is also checked for sparseness: an IR that is mostly
+    silence with a few discrete echoes is described as a list of short tap clusters plus
+    an optional second response holding only its dense stretches.
+*/
+class ImpulseResponse : public juce::ReferenceCountedObject
+{
+public:
+    using Ptr = juce::ReferenceCountedObjectPtr<ImpulseResponse>;
+
+    // a run of neighbouring significant taps, convolved directly in the time domain
+    struct TapCluster
+    {
+        int start = 0;
+        int length = 0;
+    };
+
+    /**
+        reads the whole response and scales it to unit energy, so a long hall comes out
+        about as loud as a short room. the loudest channel sets the gain for all of them
+        to keep the stereo image.
+    */
+    static Ptr createFromReader(juce::AudioFormatReader& reader)
+    {
+        const int numberOfChannels = static_cast<int>(reader.numChannels);
+        const int numberOfSamples = static_cast<int>(reader.lengthInSamples);
+
+        if(numberOfChannels == 0 || numberOfSamples == 0)
+            return nullptr;
+
+        juce::AudioBuffer<float> readBuffer(numberOfChannels, numberOfSamples);
+        reader.read(&readBuffer, 0, numberOfSamples, 0, true, true);
+
+        double maximumEnergy = 0.0;
+        for(int channel = 0; channel < numberOfChannels; ++channel)
+        {
+            const float* data = readBuffer.getReadPointer(channel);
+            double energy = 0.0;
+            for(int sample = 0; sample < numberOfSamples; ++sample)
+                energy += static_cast<double>(data[sample]) * data[sample];
+            maximumEnergy = juce::jmax(maximumEnergy, energy);
+        }
+
+        if(maximumEnergy > 0.0)
+            readBuffer.applyGain(static_cast<float>(1.0 / std::sqrt(maximumEnergy)));
+
+        return new ImpulseResponse(readBuffer, reader.sampleRate);
+    }
+
+    int getNumChannels() const noexcept { return numChannels; }
+    int getLength() const noexcept { return length; }
+    double getSampleRate() const noexcept { return sampleRate; }
+
+    const float* getReadPointer(int channel) const noexcept
+    {
+        jassert(juce::isPositiveAndBelow(channel, numChannels));
+        return samples.get() + static_cast<size_t>(channel) * channelStride;
+    }
+
+    /**
+        returns the spectra for the given partition size, building them the first time
+        they are asked for. this allocates and runs FFTs, so never call it from the audio thread.
+    */
+    const PartitionedImpulseResponse& getPartitions(int partitionSize) const
+    {
+        const juce::ScopedLock lock(partitionLock);
+
+        for(auto* partitions : partitionCache)
+            if(partitions->getPartitionSize() == partitionSize)
+                return *partitions;
+
+        return *partitionCache.add(new PartitionedImpulseResponse(*this, partitionSize));
+    }
+
+    // true when only a small fraction of the taps are significant, see analyseSparsity
+    bool isSparse() const noexcept { return sparse; }
+
+    // the short clusters of a sparse response, empty if the response isn't sparse
+    const std::vector<TapCluster>& getTapClusters(int channel) const
+    {
+        static const std::vector<TapCluster> noClusters;
+        return sparse ? tapClusters[static_cast<size_t>(channel)] : noClusters;
+    }
+    int getNumDirectTaps() const noexcept { return numDirectTaps; }
+
+    // the stretches of a sparse response too long for the tap list, or nullptr if there are none
+    Ptr getDenseParts() const { return denseParts; }
+
+    /**
+        a copy of the samples with empty caches of its own. whatever is built from it is
+        freed with it, which suits throwaway work like benchmarking engines.
+    */
+    Ptr createUncachedCopy() const
+    {
+        juce::AudioBuffer<float> copy(numChannels, length);
+
+        for(int channel = 0; channel < numChannels; ++channel)
+            copy.copyFrom(channel, 0, getReadPointer(channel), length);
+
+        return new ImpulseResponse(copy, sampleRate);
+    }
+
+    /**
+        returns the samples from start to end as a response of their own, preceded by
+        leadingSilence zeros. like the partitions, segments are built once and shared,
+        and building one allocates, so keep it away from the audio thread.
+    */
+    Ptr getSegment(int start, int end, int leadingSilence) const
+    {
+        const juce::ScopedLock lock(partitionLock);
+        const auto key = juce::String(start) + ":" + juce::String(end) + ":" + juce::String(leadingSilence);
+
+        const int index = segmentKeys.indexOf(key);
+        if(index >= 0)
+            return segmentCache[index];
+
+        juce::AudioBuffer<float> segmentSamples(numChannels, leadingSilence + end - start);
+        segmentSamples.clear();
+
+        for(int channel = 0; channel < numChannels; ++channel)
+            segmentSamples.copyFrom(channel, leadingSilence, getReadPointer(channel) + start, end - start);
+
+        Ptr segment = new ImpulseResponse(segmentSamples, sampleRate, false);
+        segmentKeys.add(key);
+        segmentCache.add(segment);
+        return segment;
+    }
+
+private:
+    ImpulseResponse(const juce::AudioBuffer<float>& source, double sampleRateOfSource, bool shouldAnalyseSparsity = true)
+        : numChannels(source.getNumChannels()),
+          length(source.getNumSamples()),
+          sampleRate(sampleRateOfSource),
+          channelStride(AlignedFloatBuffer::roundUpToAlignment(static_cast<size_t>(source.getNumSamples())))
+    {
+        samples.allocate(channelStride * static_cast<size_t>(numChannels));
+
+        for(int channel = 0; channel < numChannels; ++channel)
+            juce::FloatVectorOperations::copy(samples.get() + static_cast<size_t>(channel) * channelStride, source.getReadPointer(channel), length);
+
+        if(shouldAnalyseSparsity)
+            analyseSparsity(source);
+    }
+
+    /**
+        taps more than significantTapLevel below the peak are treated as silence. the
+        significant ones are grouped into clusters, allowing short gaps inside a cluster.
+        if few enough taps are significant, short clusters go into the tap list and longer
+        ones into the dense parts, which are convolved with FFTs.
+    */
+    void analyseSparsity(const juce::AudioBuffer<float>& source)
+    {
+        const float peak = source.getMagnitude(0, length);
+        if(peak <= 0.0f)
+            return;
+
+        const float threshold = peak * juce::Decibels::decibelsToGain(significantTapLevel);
+        juce::AudioBuffer<float> denseSamples(numChannels, length);
+        denseSamples.clear();
+
+        std::vector<std::vector<TapCluster>> clusters(static_cast<size_t>(numChannels));
+        juce::int64 numSignificantTaps = 0;
+        int numTapsInClusters = 0;
+        bool hasDenseParts = false;
+
+        for(int channel = 0; channel < numChannels; ++channel)
+        {
+            const float* data = source.getReadPointer(channel);
+            int clusterStart = -1, lastSignificantTap = -1;
+
+            auto closeCluster = [&]
+            {
+                const int clusterLength = lastSignificantTap + 1 - clusterStart;
+
+                if(clusterLength <= maximumDirectClusterLength)
+                {
+                    clusters[static_cast<size_t>(channel)].push_back({ clusterStart, clusterLength });
+                    numTapsInClusters += clusterLength;
+                }
+                else
+                {
+                    denseSamples.copyFrom(channel, clusterStart, source, channel, clusterStart, clusterLength);
+                    hasDenseParts = true;
+                }
+            };
+
+            for(int tap = 0; tap < length; ++tap)
+            {
+                if(std::abs(data[tap]) < threshold)
+                    continue;
+
+                ++numSignificantTaps;
+
+                if(clusterStart >= 0 && tap - lastSignificantTap > maximumClusterGap)
+                {
+                    closeCluster();
+                    clusterStart = -1;
+                }
+
+                if(clusterStart < 0)
+                    clusterStart = tap;
+
+                lastSignificantTap = tap;
+            }
+
+            if(clusterStart >= 0)
+                closeCluster();
+        }
+
+        const double density = static_cast<double>(numSignificantTaps) / (static_cast<double>(length) * numChannels);
+        if(density > maximumSparseDensity || numTapsInClusters > maximumDirectTaps)
+            return;
+
+        sparse = true;
+        tapClusters = std::move(clusters);
+        numDirectTaps = numTapsInClusters;
+
+        if(hasDenseParts)
+            denseParts = new ImpulseResponse(denseSamples, sampleRate, false);
+
+        DBG("Sparse IR: " + juce::String(numDirectTaps) + " direct taps, density " + juce::String(density * 100.0, 2) + "%"
+            + (hasDenseParts ? ", with dense parts" : ""));
+    }
+
+    static constexpr float significantTapLevel = -80.0f; // dB relative to the peak
+    static constexpr double maximumSparseDensity = 0.05;
+    static constexpr int maximumClusterGap = 8;
+    static constexpr int maximumDirectClusterLength = 64;
+    static constexpr int maximumDirectTaps = 1024;
+
+    const int numChannels;
+    const int length;
+    const double sampleRate;
+    const size_t channelStride;
+    AlignedFloatBuffer samples;
+
+    bool sparse = false;
+    std::vector<std::vector<TapCluster>> tapClusters;
+    int numDirectTaps = 0;
+    Ptr denseParts;
+
+    // the spectra are derived data, filling this cache doesn't change what the object represents
+    mutable juce::CriticalSection partitionLock;
+    mutable juce::OwnedArray<PartitionedImpulseResponse> partitionCache;
+    mutable juce::StringArray segmentKeys;
+    mutable juce::ReferenceCountedArray<ImpulseResponse> segmentCache;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (ImpulseResponse)
+};
+
+inline PartitionedImpulseResponse::PartitionedImpulseResponse(const ImpulseResponse& impulseResponse, int partitionSizeToUse)
+    : partitionSize(partitionSizeToUse),
+      numPartitions((impulseResponse.getLength() + partitionSizeToUse - 1) / partitionSizeToUse),
+      numChannels(impulseResponse.getNumChannels()),
+      spectrumStride(AlignedFloatBuffer::roundUpToAlignment(static_cast<size_t>(getNumBins() * 2)))
+{
+    jassert(juce::isPowerOfTwo(partitionSize));
+
+    spectra.allocate(spectrumStride * static_cast<size_t>(numPartitions * numChannels));
+    activePartitions.resize(numChannels);
+
+    const int fftSize = getFFTSize();
+    juce::dsp::FFT fft(juce::roundToInt(std::log2(fftSize)));
+    // the real only transform works in place on twice fftSize floats
+    juce::HeapBlock<float> fftBuffer(static_cast<size_t>(fftSize * 2));
+
+    for(int channel = 0; channel < numChannels; ++channel)
+    {
+        const float* impulseResponseData = impulseResponse.getReadPointer(channel);
+        auto& channelActivePartitions = activePartitions.getReference(channel);
+
+        for(int partition = 0; partition < numPartitions; ++partition)
+        {
+            const int start = partition * partitionSize;
+            const int numSamples = juce::jmin(partitionSize, impulseResponse.getLength() - start);
+
+            // silent partitions keep a zero spectrum and are skipped by the convolvers
+            const auto range = juce::FloatVectorOperations::findMinAndMax(impulseResponseData + start, numSamples);
+            if(range.getStart() == 0.0f && range.getEnd() == 0.0f)
+                continue;
+
+            channelActivePartitions.add(partition);
+
+            juce::FloatVectorOperations::clear(fftBuffer.get(), fftSize * 2);
+            juce::FloatVectorOperations::copy(fftBuffer.get(), impulseResponseData + start, numSamples);
+            fft.performRealOnlyForwardTransform(fftBuffer.get(), true);
+
+            juce::FloatVectorOperations::copy(getSpectrumForWriting(channel, partition), fftBuffer.get(), getNumBins() * 2);
+        }
+    }
+}
+
+/**
+    loads impulse responses once and hands out shared references to them,
+    so every stream using the same preset points at the same samples and spectra
+*/
+class ImpulseResponseLibrary
+{
+public:
+    ImpulseResponseLibrary()
+    {
+        formatManager.registerBasicFormats();
+    }
+
+    /**
+        in c++ const void* data represents a pointer to data of an unspecified type
+        the juce BinaryData system itself uses void* for all its resources.
+    */
+    ImpulseResponse::Ptr getFromBinaryData(const void* data, size_t dataSize)
+    {
+        const auto key = "binary:" + juce::String::toHexString(static_cast<juce::int64>(reinterpret_cast<std::uintptr_t>(data)));
+
+        if(auto existing = find(key))
+            return existing;
+
+        std::unique_ptr<juce::AudioFormatReader> reader(formatManager.createReaderFor(std::make_unique<juce::MemoryInputStream>(data, dataSize, false)));
+        return add(key, reader);
+    }
+
+private:
+    ImpulseResponse::Ptr find(const juce::String& key) const
+    {
+        const int index = keys.indexOf(key);
+        if(index < 0)
+            return nullptr;
+        return impulseResponses[index];
+    }
+
+    ImpulseResponse::Ptr add(const juce::String& key, const std::unique_ptr<juce::AudioFormatReader>& reader)
+    {
+        if(reader == nullptr)
+            return nullptr;
+
+        auto impulseResponse = ImpulseResponse::createFromReader(*reader);
+        if(impulseResponse != nullptr)
+        {
+            keys.add(key);
+            impulseResponses.add(impulseResponse);
+        }
+        return impulseResponse;
+    }
+
+    juce::AudioFormatManager formatManager;
+    juce::StringArray keys;
+    juce::ReferenceCountedArray<ImpulseResponse> impulseResponses;
+};
+
+/**
+    the streaming state that convolves one channel with one channel of an impulse response
+*/
+class ChannelConvolver
+{
+public:
+    virtual ~ChannelConvolver() = default;
+
+    // clears the input history and the pending tail
+    virtual void reset() = 0;
+
+    // input and output may point at the same samples
+    virtual void process(const float* input, float* output, int numSamples) = 0;
+};
+
+/**
+    uniformly partitioned overlap-add convolution of one channel.
+
+    only the streaming state lives here: the spectra of the last few input blocks,
+    the overlap and a few block sized scratch buffers. the impulse response spectra
+    are read from a shared PartitionedImpulseResponse.
+
+    process accepts any number of samples with no added latency. a partially filled
+    block is transformed again on every call, and the older partitions are only
+    accumulated once per block.
+*/
+class UniformPartitionedConvolver : public ChannelConvolver
+{
+public:
+    UniformPartitionedConvolver(const PartitionedImpulseResponse& partitionsToUse, int impulseResponseChannelToUse)
+        : partitions(partitionsToUse),
+          impulseResponseChannel(impulseResponseChannelToUse),
+          blockSize(partitionsToUse.getPartitionSize()),
+          fftSize(partitionsToUse.getFFTSize()),
+          numBins(partitionsToUse.getNumBins()),
+          numPartitions(partitionsToUse.getNumPartitions()),
+          stride(partitionsToUse.getSpectrumStride()),
+          activePartitions(partitionsToUse.getActivePartitions(impulseResponseChannelToUse)),
+          fft(juce::roundToInt(std::log2(partitionsToUse.getFFTSize())))
+    {
+        inputSpectra.allocate(stride * static_cast<size_t>(numPartitions));
+        accumulatedSpectrum.allocate(stride);
+        inputBlock.allocate(static_cast<size_t>(blockSize));
+        overlap.allocate(static_cast<size_t>(blockSize));
+        fftBuffer.allocate(static_cast<size_t>(fftSize * 2));
+    }
+
+    void reset() override
+    {
+        inputSpectra.clear();
+        accumulatedSpectrum.clear();
+        inputBlock.clear();
+        overlap.clear();
+        inputPosition = 0;
+        currentSegment = 0;
+    }
+
+    void process(const float* input, float* output, int numSamples) override
+    {
+        int numSamplesProcessed = 0;
+
+        while(numSamplesProcessed < numSamples)
+        {
+            const bool isStartOfBlock = inputPosition == 0;
+            const int numSamplesToProcess = juce::jmin(numSamples - numSamplesProcessed, blockSize - inputPosition);
+
+            juce::FloatVectorOperations::copy(inputBlock.get() + inputPosition, input + numSamplesProcessed, numSamplesToProcess);
+
+            // transform the current, possibly incomplete, input block
+            float* fftData = fftBuffer.get();
+            juce::FloatVectorOperations::clear(fftData, fftSize * 2);
+            juce::FloatVectorOperations::copy(fftData, inputBlock.get(), blockSize);
+            fft.performRealOnlyForwardTransform(fftData, true);
+            juce::FloatVectorOperations::copy(getInputSpectrum(currentSegment), fftData, numBins * 2);
+
+            // the older input blocks only change once per block, so their sum is kept for the whole block
+            if(isStartOfBlock)
+            {
+                accumulatedSpectrum.clear();
+
+                // silent partitions contribute nothing, so only the active ones are visited
+                for(const int partition : activePartitions)
+                {
+                    if(partition == 0)
+                        continue;
+
+                    const int segment = (currentSegment + partition) % numPartitions;
+                    multiplyAccumulate(getInputSpectrum(segment), partitions.getSpectrum(impulseResponseChannel, partition), accumulatedSpectrum.get(), numBins);
+                }
+            }
+
+            juce::FloatVectorOperations::copy(fftData, accumulatedSpectrum.get(), numBins * 2);
+            multiplyAccumulate(getInputSpectrum(currentSegment), partitions.getSpectrum(impulseResponseChannel, 0), fftData, numBins);
+            mirrorNegativeFrequencies(fftData);
+            fft.performRealOnlyInverseTransform(fftData);
+
+            juce::FloatVectorOperations::add(output + numSamplesProcessed, fftData + inputPosition, overlap.get() + inputPosition, numSamplesToProcess);
+
+            inputPosition += numSamplesToProcess;
+
+            if(inputPosition == blockSize)
+            {
+                // the second half of the last transform rings into the next block
+                juce::FloatVectorOperations::copy(overlap.get(), fftData + blockSize, blockSize);
+                inputBlock.clear();
+                inputPosition = 0;
+                currentSegment = currentSegment > 0 ? currentSegment - 1 : numPartitions - 1;
+            }
+
+            numSamplesProcessed += numSamplesToProcess;
+        }
+    }
+
+private:
+    float* getInputSpectrum(int segment) noexcept
+    {
+        return inputSpectra.get() + static_cast<size_t>(segment) * stride;
+    }
+
+    // accumulator += a * b for interleaved complex bins
+    static void multiplyAccumulate(const float* a, const float* b, float* accumulator, int numberOfBins) noexcept
+    {
+        for(int bin = 0; bin < numberOfBins; ++bin)
+        {
+            const float aReal = a[2 * bin], aImaginary = a[2 * bin + 1];
+            const float bReal = b[2 * bin], bImaginary = b[2 * bin + 1];
+
+            accumulator[2 * bin]     += aReal * bReal - aImaginary * bImaginary;
+            accumulator[2 * bin + 1] += aReal * bImaginary + aImaginary * bReal;
+        }
+    }
+
+    // the inverse transform expects the full conjugate symmetric spectrum
+    void mirrorNegativeFrequencies(float* spectrum) const noexcept
+    {
+        for(int bin = 1; bin < fftSize / 2; ++bin)
+        {
+            spectrum[2 * (fftSize - bin)]     =  spectrum[2 * bin];
+            spectrum[2 * (fftSize - bin) + 1] = -spectrum[2 * bin + 1];
+        }
+    }
+
+    const PartitionedImpulseResponse& partitions;
+    const int impulseResponseChannel;
+    const int blockSize, fftSize, numBins, numPartitions;
+    const size_t stride;
+    const juce::Array<int>& activePartitions;
+    juce::dsp::FFT fft;
+
+    AlignedFloatBuffer inputSpectra;
+    AlignedFloatBuffer accumulatedSpectrum;
+    AlignedFloatBuffer inputBlock;
+    AlignedFloatBuffer overlap;
+    AlignedFloatBuffer fftBuffer;
+    int inputPosition = 0;
+    int currentSegment = 0;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (UniformPartitionedConvolver)
+};
+
+/**
+    convolution of one channel with a sparse impulse response.
+
+    every tap in the response's tap clusters is one vectorised multiply-add against a
+    delayed copy of the input, so the cost follows the number of real echoes rather than
+    the length of the response. the dense parts, if there are any, are handed to
+    another convolver and the two results are summed.
+*/
+class SparseTapConvolver : public ChannelConvolver
+{
+public:
+    SparseTapConvolver(const ImpulseResponse& impulseResponse, int impulseResponseChannelToUse,
+                       std::unique_ptr<ChannelConvolver> denseConvolverToUse)
+        : SparseTapConvolver(impulseResponse.getReadPointer(impulseResponseChannelToUse),
+                             impulseResponse.getTapClusters(impulseResponseChannelToUse),
+                             std::move(denseConvolverToUse))
+    {
+    }
+
+    // taps must stay valid for the lifetime of the convolver, the clusters index into it
+    SparseTapConvolver(const float* tapsToUse, std::vector<ImpulseResponse::TapCluster> clustersToUse,
+                       std::unique_ptr<ChannelConvolver> denseConvolverToUse)
+        : taps(tapsToUse),
+          clusters(std::move(clustersToUse)),
+          denseConvolver(std::move(denseConvolverToUse))
+    {
+        int longestDelay = 0;
+        for(const auto& cluster : clusters)
+            longestDelay = juce::jmax(longestDelay, cluster.start + cluster.length - 1);
+
+        // the history has to reach back over the longest delay from the end of a chunk
+        historySize = juce::nextPowerOfTwo(longestDelay + maximumChunkSize);
+
+        // every sample is written twice, so any window of up to historySize samples is contiguous
+        history.allocate(static_cast<size_t>(historySize * 2));
+    }
+
+    void reset() override
+    {
+        history.clear();
+        writePosition = 0;
+
+        if(denseConvolver != nullptr)
+            denseConvolver->reset();
+    }
+
+    void process(const float* input, float* output, int numSamples) override
+    {
+        int numSamplesProcessed = 0;
+
+        while(numSamplesProcessed < numSamples)
+        {
+            const int numSamplesToProcess = juce::jmin(numSamples - numSamplesProcessed, maximumChunkSize);
+            const float* chunkInput = input + numSamplesProcessed;
+            float* chunkOutput = output + numSamplesProcessed;
+
+            // keep the input before the dense convolver overwrites it in place
+            writeToHistory(chunkInput, numSamplesToProcess);
+
+            if(denseConvolver != nullptr)
+                denseConvolver->process(chunkInput, chunkOutput, numSamplesToProcess);
+            else
+                juce::FloatVectorOperations::clear(chunkOutput, numSamplesToProcess);
+
+            for(const auto& cluster : clusters)
+            {
+                for(int delay = cluster.start; delay < cluster.start + cluster.length; ++delay)
+                {
+                    if(taps[delay] == 0.0f)
+                        continue;
+
+                    const int readPosition = (writePosition - delay) & (historySize - 1);
+                    juce::FloatVectorOperations::addWithMultiply(chunkOutput, history.get() + readPosition, taps[delay], numSamplesToProcess);
+                }
+            }
+
+            writePosition = (writePosition + numSamplesToProcess) & (historySize - 1);
+            numSamplesProcessed += numSamplesToProcess;
+        }
+    }
+
+private:
+    void writeToHistory(const float* source, int numSamples) noexcept
+    {
+        const int numBeforeWrap = juce::jmin(numSamples, historySize - writePosition);
+        float* historyData = history.get();
+
+        juce::FloatVectorOperations::copy(historyData + writePosition, source, numBeforeWrap);
+        juce::FloatVectorOperations::copy(historyData + writePosition + historySize, source, numBeforeWrap);
+
+        if(numBeforeWrap < numSamples)
+        {
+            juce::FloatVectorOperations::copy(historyData, source + numBeforeWrap, numSamples - numBeforeWrap);
+            juce::FloatVectorOperations::copy(historyData + historySize, source + numBeforeWrap, numSamples - numBeforeWrap);
+        }
+    }
+
+    static constexpr int maximumChunkSize = 4096;
+
+    const float* taps;
+    const std::vector<ImpulseResponse::TapCluster> clusters;
+    std::unique_ptr<ChannelConvolver> denseConvolver;
+
+    AlignedFloatBuffer history;
+    int historySize = 0;
+    int writePosition = 0;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (SparseTapConvolver)
+};
+
+/**
+    re-blocks audio arriving in arbitrarily sized chunks into fixed blocks of blockSize samples.
+
+    the host's odd or varying buffer sizes are collected in an input FIFO, every full block is
+    handed to the engine in one go, and the result is played back from an output FIFO. this
+    adds exactly blockSize samples of latency, in exchange every block costs the same no
+    matter how the host chunks the audio.
+*/
+class BlockSizeAdapter
+{
+public:
+    void prepare(int blockSizeToUse, int numberOfChannels)
+    {
+        blockSize = blockSizeToUse;
+        numChannels = numberOfChannels;
+        channelStride = AlignedFloatBuffer::roundUpToAlignment(static_cast<size_t>(blockSize));
+        inputFifo.allocate(channelStride * static_cast<size_t>(numChannels));
+        outputFifo.allocate(channelStride * static_cast<size_t>(numChannels));
+        fifoPosition = 0;
+    }
+
+    void reset()
+    {
+        inputFifo.clear();
+        outputFifo.clear();
+        fifoPosition = 0;
+    }
+
+    int getLatencyInSamples() const noexcept { return blockSize; }
+
+    /**
+        processes the first numberOfChannels channels of buffer in place.
+        processBlock (channel, input, output) is called once per channel for every full block.
+    */
+    template <typename ProcessBlockFunction>
+    void process(juce::AudioBuffer<float>& buffer, int numberOfChannels, ProcessBlockFunction&& processBlock)
+    {
+        jassert(numberOfChannels <= numChannels);
+
+        const int numberOfSamples = buffer.getNumSamples();
+        int numSamplesProcessed = 0;
+
+        while(numSamplesProcessed < numberOfSamples)
+        {
+            const int numSamplesToProcess = juce::jmin(numberOfSamples - numSamplesProcessed, blockSize - fifoPosition);
+
+            for(int channel = 0; channel < numberOfChannels; ++channel)
+            {
+                float* channelData = buffer.getWritePointer(channel) + numSamplesProcessed;
+
+                // the input has to be stored before the output overwrites it
+                juce::FloatVectorOperations::copy(getInputFifo(channel) + fifoPosition, channelData, numSamplesToProcess);
+                juce::FloatVectorOperations::copy(channelData, getOutputFifo(channel) + fifoPosition, numSamplesToProcess);
+            }
+
+            fifoPosition += numSamplesToProcess;
+            numSamplesProcessed += numSamplesToProcess;
+
+            if(fifoPosition == blockSize)
+            {
+                for(int channel = 0; channel < numberOfChannels; ++channel)
+                    processBlock(channel, static_cast<const float*>(getInputFifo(channel)), getOutputFifo(channel));
+
+                fifoPosition = 0;
+            }
+        }
+    }
+
+private:
+    float* getInputFifo(int channel) noexcept { return inputFifo.get() + static_cast<size_t>(channel) * channelStride; }
+    float* getOutputFifo(int channel) noexcept { return outputFifo.get() + static_cast<size_t>(channel) * channelStride; }
+
+    int blockSize = 0;
+    int numChannels = 0;
+    size_t channelStride = 0;
+    AlignedFloatBuffer inputFifo;
+    AlignedFloatBuffer outputFifo;
+    int fifoPosition = 0;
+};
+
+/**
+    non-uniformly partitioned convolution of one channel.
+
+    the start of the response is convolved with small partitions so it responds straight
+    away, later stretches use partitions four times larger each time, up to
+    maximumPartitionSize. each later segment collects its own input in a BlockSizeAdapter,
+    whose latency of one partition is hidden by starting the segment at least that far
+    into the response. long responses then need far fewer multiply-adds per sample, at
+    the price of an occasional large FFT.
+*/
+class NonUniformPartitionedConvolver : public ChannelConvolver
+{
+public:
+    NonUniformPartitionedConvolver(const ImpulseResponse& impulseResponse, int impulseResponseChannel,
+                                   int headPartitionSize, int maximumPartitionSize)
+    {
+        jassert(maximumPartitionSize >= headPartitionSize);
+
+        const int length = impulseResponse.getLength();
+        int segmentStart = juce::jmin(length, headPartitionSize * partitionsPerSegment);
+
+        headImpulseResponse = impulseResponse.getSegment(0, segmentStart, 0);
+        head = std::make_unique<UniformPartitionedConvolver>(headImpulseResponse->getPartitions(headPartitionSize), impulseResponseChannel);
+
+        int partitionSize = headPartitionSize;
+
+        while(segmentStart < length)
+        {
+            partitionSize = juce::jmin(partitionSize * partitionsPerSegment, maximumPartitionSize);
+
+            // once the partitions can't grow any more the last segment runs to the end
+            const int segmentEnd = partitionSize == maximumPartitionSize ? length
+                                                                         : juce::jmin(length, segmentStart + partitionSize * (partitionsPerSegment - 1));
+
+            auto segment = std::make_unique<TailSegment>();
+            segment->partitionSize = partitionSize;
+
+            // the FIFO delays the segment by one partition, the rest of its offset is leading silence
+            segment->impulseResponse = impulseResponse.getSegment(segmentStart, segmentEnd, segmentStart - partitionSize);
+            segment->convolver = std::make_unique<UniformPartitionedConvolver>(segment->impulseResponse->getPartitions(partitionSize), impulseResponseChannel);
+            segment->adapter.prepare(partitionSize, 1);
+            tailSegments.push_back(std::move(segment));
+
+            segmentStart = segmentEnd;
+        }
+
+        segmentScratch.allocate(static_cast<size_t>(maximumChunkSize));
+        tailOutput.allocate(static_cast<size_t>(maximumChunkSize));
+    }
+
+    void reset() override
+    {
+        head->reset();
+
+        for(auto& segment : tailSegments)
+        {
+            segment->convolver->reset();
+            segment->adapter.reset();
+        }
+    }
+
+    void process(const float* input, float* output, int numSamples) override
+    {
+        int numSamplesProcessed = 0;
+
+        while(numSamplesProcessed < numSamples)
+        {
+            const int numSamplesToProcess = juce::jmin(numSamples - numSamplesProcessed, maximumChunkSize);
+            const float* chunkInput = input + numSamplesProcessed;
+            float* chunkOutput = output + numSamplesProcessed;
+
+            // the later segments have to see the input before the head overwrites it in place
+            juce::FloatVectorOperations::clear(tailOutput.get(), numSamplesToProcess);
+
+            for(auto& segment : tailSegments)
+            {
+                juce::FloatVectorOperations::copy(segmentScratch.get(), chunkInput, numSamplesToProcess);
+
+                float* scratchChannels[] = { segmentScratch.get() };
+                juce::AudioBuffer<float> scratchBuffer(scratchChannels, 1, numSamplesToProcess);
+                auto& tailSegment = *segment;
+
+                tailSegment.adapter.process(scratchBuffer, 1, [&tailSegment](int, const float* blockInput, float* blockOutput) {
+                    tailSegment.convolver->process(blockInput, blockOutput, tailSegment.partitionSize);
+                });
+
+                juce::FloatVectorOperations::add(tailOutput.get(), segmentScratch.get(), numSamplesToProcess);
+            }
+
+            head->process(chunkInput, chunkOutput, numSamplesToProcess);
+            juce::FloatVectorOperations::add(chunkOutput, tailOutput.get(), numSamplesToProcess);
+
+            numSamplesProcessed += numSamplesToProcess;
+        }
+    }
+
+private:
+    struct TailSegment
+    {
+        int partitionSize = 0;
+        ImpulseResponse::Ptr impulseResponse;
+        std::unique_ptr<UniformPartitionedConvolver> convolver;
+        BlockSizeAdapter adapter;
+    };
+
+    static constexpr int partitionsPerSegment = 4;
+    static constexpr int maximumChunkSize = 4096;
+
+    ImpulseResponse::Ptr headImpulseResponse;
+    std::unique_ptr<UniformPartitionedConvolver> head;
+    std::vector<std::unique_ptr<TailSegment>> tailSegments;
+    AlignedFloatBuffer segmentScratch;
+    AlignedFloatBuffer tailOutput;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (NonUniformPartitionedConvolver)
+};
+
+/**
+    which convolver to build for an impulse response, as chosen by the autotuner
+    or by getDefault when nothing has been measured yet
+*/
+struct EngineConfiguration
+{
+    enum class Type
+    {
+        direct,     // every tap in the time domain
+        uniform,    // equally sized FFT partitions
+        nonUniform, // FFT partitions growing up to maximumPartitionSize
+        sparse      // tap clusters plus FFT for the dense parts
+    };
+
+    Type type = Type::uniform;
+    int maximumPartitionSize = 0;
+
+    bool operator==(const EngineConfiguration& other) const noexcept { return type == other.type && maximumPartitionSize == other.maximumPartitionSize; }
+    bool operator!=(const EngineConfiguration& other) const noexcept { return ! operator==(other); }
+
+    static EngineConfiguration getDefault(const ImpulseResponse& impulseResponse)
+    {
+        return { impulseResponse.isSparse() ? Type::sparse : Type::uniform, 0 };
+    }
+
+    juce::String toString() const
+    {
+        switch(type)
+        {
+            case Type::direct:      return "direct";
+            case Type::nonUniform:  return "nonuniform:" + juce::String(maximumPartitionSize);
+            case Type::sparse:      return "sparse";
+            case Type::uniform:     break;
+        }
+        return "uniform";
+    }
+
+    static EngineConfiguration fromString(const juce::String& text)
+    {
+        if(text == "direct")
+            return { Type::direct, 0 };
+        if(text == "sparse")
+            return { Type::sparse, 0 };
+        if(text.startsWith("nonuniform:"))
+            return { Type::nonUniform, text.fromFirstOccurrenceOf(":", false, false).getIntValue() };
+        return { Type::uniform, 0 };
+    }
+};
+
+/**
+    builds the streaming state for one channel. partitionSize is the block size the
+    convolver is mostly fed with, the engines that use FFTs start out at that size.
+*/
+inline std::unique_ptr<ChannelConvolver> createChannelConvolver(const ImpulseResponse& impulseResponse, int impulseResponseChannel,
+                                                                int partitionSize, const EngineConfiguration& configuration)
+{
+    using Type = EngineConfiguration::Type;
+
+    switch(configuration.type)
+    {
+        case Type::direct:
+            // a tap list that simply covers every tap
+            return std::make_unique<SparseTapConvolver>(impulseResponse.getReadPointer(impulseResponseChannel),
+                                                        std::vector<ImpulseResponse::TapCluster> { { 0, impulseResponse.getLength() } },
+                                                        nullptr);
+
+        case Type::nonUniform:
+            if(configuration.maximumPartitionSize > partitionSize)
+                return std::make_unique<NonUniformPartitionedConvolver>(impulseResponse, impulseResponseChannel, partitionSize, configuration.maximumPartitionSize);
+            break;
+
+        case Type::sparse:
+            if(impulseResponse.isSparse())
+            {
+                std::unique_ptr<ChannelConvolver> denseConvolver;
+                if(auto denseParts = impulseResponse.getDenseParts())
+                    denseConvolver = std::make_unique<UniformPartitionedConvolver>(denseParts->getPartitions(partitionSize), impulseResponseChannel);
+
+                return std::make_unique<SparseTapConvolver>(impulseResponse, impulseResponseChannel, std::move(denseConvolver));
+            }
+            break;
+
+        case Type::uniform:
+            break;
+    }
+
+    return std::make_unique<UniformPartitionedConvolver>(impulseResponse.getPartitions(partitionSize), impulseResponseChannel);
+}
@@ -15,7 +15,7 @@ MainComponent::MainComponent():
     waveformDisplay.setTransportSource(&transportSource);
     addAndMakeVisible(waveformDisplay); // adds the component to the parent's hierarchy - a must for rendering anything
     
-    convolutionProcessor = std::make_unique<ConvolutionProcessor>(timeDomainConvolution);
+    convolutionProcessor = std::make_unique<ConvolutionProcessor>();
     convolutionProcessor->setAudioSource(&transportSource);
     
     processorPlayer.setProcessor(convolutionProcessor.get());
@@ -32,14 +32,31 @@ MainComponent::MainComponent():
     
     addAndMakeVisible(convolutionOptions);
     convolutionOptions.addListener(this);
-    setSize(600, 400);
+    
+    exportFormatOptions.addItem("Export as WAV 24-bit", 1);
+    exportFormatOptions.addItem("Export as WAV 32-bit float", 2);
+    exportFormatOptions.addItem("Export as FLAC 24-bit", 3);
+    exportFormatOptions.setSelectedItemIndex(0);
+    addAndMakeVisible(exportFormatOptions);
+    
+    exportStatusLabel.setJustificationType(juce::Justification::centred);
+    addAndMakeVisible(exportStatusLabel);
+    
+    readAheadStatusLabel.setJustificationType(juce::Justification::centred);
+    addAndMakeVisible(readAheadStatusLabel);
+    
+    readAheadThread.startThread();
+    startTimer(250);
+    setSize(600, 490);
 }
 
 MainComponent::~MainComponent()
 {
+    stopTimer();
     processorPlayer.setProcessor(nullptr);
     transportSource.setSource(nullptr);
     deviceManager.removeAudioCallback(&processorPlayer);
+    readAheadThread.stopThread(1000);
 }
 
 // used only for graphics only and not layout
@@ -75,6 +92,14 @@ void MainComponent::resized()
     
     flex.items.add(juce::FlexItem(convolutionOptions).withFlex(1.0f).withWidth(getWidth() * 0.5f).withHeight(30));
 
+    flex.items.add(juce::FlexItem().withHeight(10));
+
+    flex.items.add(juce::FlexItem(exportFormatOptions).withFlex(1.0f).withWidth(getWidth() * 0.5f).withHeight(30));
+
+    flex.items.add(juce::FlexItem(exportStatusLabel).withFlex(1.0f).withWidth(getWidth() * 0.9f).withHeight(24));
+
+    flex.items.add(juce::FlexItem(readAheadStatusLabel).withFlex(1.0f).withWidth(getWidth() * 0.9f).withHeight(24));
+
     flex.performLayout(getLocalBounds().reduced(10));
 }
 
@@ -95,41 +120,77 @@ void MainComponent::comboBoxChanged(juce::ComboBox* comboBoxThatHasChanged)
         }
         else
         {
+            // the library loads each preset once, switching back to it just shares the same data
+            ImpulseResponse::Ptr impulseResponse;
             switch (selectedId)
             {
                 case 2:
-                    timeDomainConvolution.loadImpulseResponseFromBinaryDataInAssets(BinaryData::BIG_HALL_wav, BinaryData::BIG_HALL_wavSize);
+                    impulseResponse = impulseResponseLibrary.getFromBinaryData(BinaryData::BIG_HALL_wav, BinaryData::BIG_HALL_wavSize);
                     break;
                 case 3:
-                    timeDomainConvolution.loadImpulseResponseFromBinaryDataInAssets(BinaryData::Metallic_delay_effect_wav, BinaryData::Metallic_delay_effect_wavSize);
+                    impulseResponse = impulseResponseLibrary.getFromBinaryData(BinaryData::Metallic_delay_effect_wav, BinaryData::Metallic_delay_effect_wavSize);
                     break;
                 case 4:
-                    timeDomainConvolution.loadImpulseResponseFromBinaryDataInAssets(BinaryData::SMALL_CHURCH_wav, BinaryData::SMALL_CHURCH_wavSize);
+                    impulseResponse = impulseResponseLibrary.getFromBinaryData(BinaryData::SMALL_CHURCH_wav, BinaryData::SMALL_CHURCH_wavSize);
                     break;
                 case 5:
-                    timeDomainConvolution.loadImpulseResponseFromBinaryDataInAssets(BinaryData::decaying_white_noise_wav, BinaryData::decaying_white_noise_wavSize);
+                    impulseResponse = impulseResponseLibrary.getFromBinaryData(BinaryData::decaying_white_noise_wav, BinaryData::decaying_white_noise_wavSize);
                     break;
             }
-            DBG("Loaded IR with length: " + juce::String(timeDomainConvolution.getImpulseResponseLength()));
-            DBG("IR first sample value: " + juce::String(timeDomainConvolution.getFirstSampleValue()));
+            convolutionProcessor->setImpulseResponse(impulseResponse);
+            if (impulseResponse != nullptr)
+            {
+                DBG("Loaded IR with length: " + juce::String(impulseResponse->getLength()));
+                DBG("IR first sample value: " + juce::String(impulseResponse->getReadPointer(0)[0]));
+            }
             convolutionProcessor->setConvolutionEnabled(true);
             // create a preview of the convolved audio for visualization
             if (currentFileChooser && currentFileChooser->getResult().exists())
             {
                 auto file = currentFileChooser->getResult();
+                juce::Component::SafePointer<MainComponent> safeThis(this);
+                // a coarse envelope shows up first and is replaced by the full render when it is done
                 convolutionProcessor->createConvolvedPreview(file,
-                                                             [this](const juce::AudioBuffer<float>& buffer, double sampleRate) {
-                    waveformDisplay.setConvolvedSource(buffer, sampleRate);
+                                                             [safeThis](std::shared_ptr<const juce::AudioBuffer<float>> buffer, double sampleRate, bool isFinal) {
+                    if (safeThis != nullptr)
+                        safeThis->waveformDisplay.setConvolvedSource(std::move(buffer), sampleRate, ! isFinal);
                 });
             }
             // reconnect the processor and restart if needed
             processorPlayer.setProcessor(convolutionProcessor.get());
             if(wasPlaying)
                 transportSource.start();
+            
+            // the first time this response meets this block size and sample rate, time the engines in the background
+            // and rebuild with the winner once it is known
+            const int partitionSize = convolutionProcessor->getConvolutionPartitionSize();
+            if (partitionSize > 0)
+            {
+                juce::Component::SafePointer<MainComponent> safeThis(this);
+                autotuner.tuneInBackground(impulseResponse, partitionSize, convolutionProcessor->getSampleRate(), [safeThis, impulseResponse](const EngineConfiguration&) {
+                    if (safeThis == nullptr || ! safeThis->convolutionProcessor->getConvolutionEnabled()
+                        || safeThis->convolutionProcessor->getImpulseResponse() != impulseResponse)
+                        return;
+                    
+                    // only the engine is swapped, playback and the read-ahead buffer carry on untouched
+                    safeThis->convolutionProcessor->updateConvolutionEngine();
+                });
+            }
         }
     }
 }
 
+void MainComponent::timerCallback()
+{
+    if (readAheadSource == nullptr)
+        return;
+    
+    readAheadStatusLabel.setText("Read-ahead buffer " + juce::String(juce::roundToInt(readAheadSource->getBufferFillLevel() * 100.0)) + "% full, "
+                                 + juce::String(readAheadSource->getNumUnderruns()) + " underruns ("
+                                 + juce::String(readAheadSource->getNumSamplesMissed()) + " samples missed)",
+                                 juce::dontSendNotification);
+}
+
 void MainComponent::loadWavFileButtonClicked()
 {
     loadWavFile();
@@ -156,6 +217,63 @@ void MainComponent::shouldLoopToggled(bool shouldLoop)
     }
 }
 
+void MainComponent::exportButtonClicked()
+{
+    if (currentFileChooser == nullptr || ! currentFileChooser->getResult().existsAsFile())
+    {
+        exportStatusLabel.setText("Load a WAV file before exporting", juce::dontSendNotification);
+        return;
+    }
+    if (exporter.isExporting())
+    {
+        exportStatusLabel.setText("An export is already running", juce::dontSendNotification);
+        return;
+    }
+    
+    ConvolvedAudioExporter::Format format = ConvolvedAudioExporter::Format::wav24Bit;
+    switch (exportFormatOptions.getSelectedId())
+    {
+        case 2:
+            format = ConvolvedAudioExporter::Format::wav32BitFloat;
+            break;
+        case 3:
+            format = ConvolvedAudioExporter::Format::flac24Bit;
+            break;
+    }
+    
+    auto sourceFile = currentFileChooser->getResult();
+    auto extension = ConvolvedAudioExporter::getFileExtension(format);
+    auto defaultFile = sourceFile.getSiblingFile(sourceFile.getFileNameWithoutExtension() + "_convolved").withFileExtension(extension);
+    
+    exportFileChooser = std::make_unique<juce::FileChooser>("Export convolved audio...", defaultFile, "*" + extension);
+    auto flags = juce::FileBrowserComponent::saveMode | juce::FileBrowserComponent::canSelectFiles | juce::FileBrowserComponent::warnAboutOverwriting;
+    
+    exportFileChooser->launchAsync(flags, [this, sourceFile, format, extension](const juce::FileChooser& fc) {
+        auto destination = fc.getResult();
+        if (destination == juce::File{})
+            return;
+        
+        const bool shouldConvolve = convolutionOptions.getSelectedId() != 1;
+        juce::Component::SafePointer<MainComponent> safeThis(this);
+        
+        auto result = exporter.startExport(sourceFile, destination.withFileExtension(extension), format,
+                                           convolutionProcessor->getImpulseResponse(), shouldConvolve,
+                                           [safeThis](const ConvolvedAudioExporter::Result& exportResult) {
+            if (safeThis == nullptr)
+                return;
+            
+            if (exportResult.wasSuccessful)
+                safeThis->exportStatusLabel.setText("Exported " + juce::String(exportResult.audioLengthSeconds, 1) + " s of audio at "
+                                                    + juce::String(exportResult.getRealtimeMultiple(), 1) + "x real time",
+                                                    juce::dontSendNotification);
+            else
+                safeThis->exportStatusLabel.setText("Export failed: " + exportResult.errorMessage, juce::dontSendNotification);
+        });
+        
+        exportStatusLabel.setText(result.wasOk() ? juce::String("Exporting...") : "Export failed: " + result.getErrorMessage(), juce::dontSendNotification);
+    });
+}
+
 void MainComponent::loadWavFile()
 {
     currentFileChooser = std::make_unique<juce::FileChooser>("Select a WAV file...", juce::File{}, "*.wav");
@@ -168,7 +286,10 @@ void MainComponent::loadWavFile()
             std::unique_ptr<juce::AudioFormatReader> reader(audioFormatManager->createReaderFor(file));
             if(reader != nullptr) {
                 auto newSource = std::make_unique<juce::AudioFormatReaderSource>(reader.get(), false);
-                transportSource.setSource(newSource.get(), 0, nullptr, reader->sampleRate);
+                // the transport reads through our own read-ahead stage, so it needs no buffering of its own
+                auto newReadAheadSource = std::make_unique<ReadAheadAudioSource>(*newSource, readAheadThread, static_cast<int>(reader->numChannels), readAheadBufferSize);
+                transportSource.setSource(newReadAheadSource.get(), 0, nullptr, reader->sampleRate);
+                readAheadSource = std::move(newReadAheadSource);
                 readerSource = std::move(newSource);
                 audioFormatReader.reset(reader.release());
                 
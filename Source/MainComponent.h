@@ -1,18 +1,24 @@
 #pragma once
 
 #include <JuceHeader.h>
+#include "ConvolutionEngine.h"
+#include "ConvolutionAutotuner.h"
+#include "ReadAheadAudioSource.h"
 
 class AudioWaveFormComponent: public juce::Component, public juce::ChangeListener, public juce::Timer
 {
 public:
-    AudioWaveFormComponent(juce::AudioFormatManager& formatManagerToUse): formatManager(&formatManagerToUse), thumbnailCache(5)
+    AudioWaveFormComponent(juce::AudioFormatManager& formatManagerToUse): thumbnailCache(5)
     {
-        // create two audio thumbnails - one for original audio, one for convolved
-        originalThumbnail = std::make_unique<juce::AudioThumbnail>(512, formatManagerToUse, thumbnailCache);
+        // create three audio thumbnails - one for original audio, one for convolved and one for the coarse convolved preview
+        originalThumbnail = std::make_unique<juce::AudioThumbnail>(samplesPerThumbnailSample, formatManagerToUse, thumbnailCache);
         originalThumbnail->addChangeListener(this);
        
-        convolvedThumbnail = std::make_unique<juce::AudioThumbnail>(512, formatManagerToUse, thumbnailCache);
+        convolvedThumbnail = std::make_unique<juce::AudioThumbnail>(samplesPerThumbnailSample, formatManagerToUse, thumbnailCache);
         convolvedThumbnail->addChangeListener(this);
+        
+        // the coarse preview arrives at a fraction of the sample rate, with the same resolution it would only be a few steps
+        approximateThumbnail = std::make_unique<juce::AudioThumbnail>(samplesPerApproximateThumbnailSample, formatManagerToUse, thumbnailCache);
         startTimer(40);
     }
 
@@ -38,36 +44,39 @@ public:
         }
     }
     
-    void setConvolvedSource(const juce::AudioBuffer<float>& buffer, double sampleRate)
+    /**
+        replaces the convolved waveform in place. the progressive preview first passes a coarse
+        approximation, drawn with an "approximate" label, and then the full resolution render.
+        the full render can be minutes of audio, so it is added to its thumbnail a little on
+        every timer callback and the approximation stays up until it is complete.
+    */
+    void setConvolvedSource(std::shared_ptr<const juce::AudioBuffer<float>> buffer, double sampleRate, bool isApproximate = false)
     {
-        // create a temporary file to store the convolved audio
-        juce::File tempFile = juce::File::createTempFile("convolved.wav");
-
-        // create a writer for the file
-        std::unique_ptr<juce::AudioFormatWriter> writer(
-                    formatManager->findFormatForFileExtension("wav")->createWriterFor(
-                        new juce::FileOutputStream(tempFile),
-                        sampleRate,
-                        buffer.getNumChannels(),
-                        16, // bit depth
-                        {}, // metadata
-                        0 // quality option
-                    )
-                );
-                
-        if (writer != nullptr)
-        {
-            writer->writeFromAudioSampleBuffer(buffer, 0, buffer.getNumSamples());
-            writer.reset();
+        // feed the thumbnail straight from memory, no need to go through a temporary file
+        auto& thumbnail = isApproximate ? *approximateThumbnail : *convolvedThumbnail;
+        thumbnail.reset(buffer->getNumChannels(), sampleRate, buffer->getNumSamples());
         
-            // set the convolved thumbnail source to the temporary file
-            convolvedThumbnail->setSource(new juce::FileInputSource(tempFile));
-            isShowingConvolved = true;
-            repaint();
+        if(isApproximate)
+        {
+            // a newer preview replaces whatever was still being added
+            pendingConvolvedBuffer.reset();
+            thumbnail.addBlock(0, *buffer, 0, buffer->getNumSamples());
+            isConvolvedApproximate = true;
         }
+        else
+        {
+            pendingConvolvedBuffer = std::move(buffer);
+            numPendingSamplesAdded = 0;
+            addPendingConvolvedSamples();
+        }
+        
+        isShowingConvolved = true;
+        repaint();
     }
+    
     void clearConvolvedSource()
     {
+        pendingConvolvedBuffer.reset();
         isShowingConvolved = false;
         repaint();
     }
@@ -101,11 +110,12 @@ public:
                 g.setColour(juce::Colours::lightgreen);
                 g.drawRect(thumbArea, 1);
                 g.setColour(juce::Colours::white);
-                convolvedThumbnail->drawChannels(g, thumbArea, 0.0f, convolvedThumbnail->getTotalLength(), 1.0f);
+                auto& shownThumbnail = isConvolvedApproximate ? *approximateThumbnail : *convolvedThumbnail;
+                shownThumbnail.drawChannels(g, thumbArea, 0.0f, shownThumbnail.getTotalLength(), 1.0f);
                 
                 // Label for convolved audio
                 g.setColour(juce::Colours::white);
-                g.drawText("Convolved", thumbArea.reduced(5), juce::Justification::topLeft, false);
+                g.drawText(isConvolvedApproximate ? "Convolved (approximate, refining...)" : "Convolved", thumbArea.reduced(5), juce::Justification::topLeft, false);
                 
                 // Draw playhead in both sections
                 if(transportSource != nullptr)
@@ -116,7 +126,7 @@ public:
                     g.drawLine(drawPosition + topHalf.getX(), topHalf.getY(),
                                drawPosition + topHalf.getX(), topHalf.getBottom(), 2.0f);
                     
-                    drawPosition = (currentPosition / convolvedThumbnail->getTotalLength()) * thumbArea.getWidth();
+                    drawPosition = (currentPosition / shownThumbnail.getTotalLength()) * thumbArea.getWidth();
                     g.drawLine(drawPosition + thumbArea.getX(), thumbArea.getY(),
                                drawPosition + thumbArea.getX(), thumbArea.getBottom(), 2.0f);
                 }
@@ -150,6 +160,9 @@ public:
     
     void timerCallback() override
     {
+        if(pendingConvolvedBuffer != nullptr)
+            addPendingConvolvedSamples();
+        
         if(transportSource != nullptr)
         {
             currentPosition = transportSource->getCurrentPosition();
@@ -158,14 +171,47 @@ public:
     }
     
 private:
-    juce::AudioFormatManager* formatManager;
+    // adds the full render in chunks until about pendingSamplesTimeBudget milliseconds have passed
+    void addPendingConvolvedSamples()
+    {
+        const auto startTime = juce::Time::getMillisecondCounterHiRes();
+        const int numSamples = pendingConvolvedBuffer->getNumSamples();
+        
+        while(numPendingSamplesAdded < numSamples
+              && juce::Time::getMillisecondCounterHiRes() - startTime < pendingSamplesTimeBudget)
+        {
+            const int numToAdd = juce::jmin(pendingSamplesChunkSize, numSamples - numPendingSamplesAdded);
+            convolvedThumbnail->addBlock(numPendingSamplesAdded, *pendingConvolvedBuffer, numPendingSamplesAdded, numToAdd);
+            numPendingSamplesAdded += numToAdd;
+        }
+        
+        if(numPendingSamplesAdded >= numSamples)
+        {
+            pendingConvolvedBuffer.reset();
+            isConvolvedApproximate = false;
+            repaint();
+        }
+    }
+    
+    static constexpr int samplesPerThumbnailSample = 512;
+    // matches the 1/64 sample rate of ConvolutionProcessor's coarse preview
+    static constexpr int samplesPerApproximateThumbnailSample = samplesPerThumbnailSample / 64;
+    
     std::unique_ptr<juce::AudioThumbnail> originalThumbnail;
     std::unique_ptr<juce::AudioThumbnail> convolvedThumbnail;
+    std::unique_ptr<juce::AudioThumbnail> approximateThumbnail;
     juce::AudioThumbnailCache thumbnailCache { 100 };
     juce::AudioTransportSource* transportSource = nullptr;
     double currentPosition = 0.0;
     juce::File currentFile;
     bool isShowingConvolved = false;
+    bool isConvolvedApproximate = false;
+    
+    // the full render while it is being added to convolvedThumbnail
+    std::shared_ptr<const juce::AudioBuffer<float>> pendingConvolvedBuffer;
+    int numPendingSamplesAdded = 0;
+    static constexpr int pendingSamplesChunkSize = 65536;
+    static constexpr double pendingSamplesTimeBudget = 10.0;
 };
 
 
@@ -179,6 +225,7 @@ public:
         virtual void loadWavFileButtonClicked() = 0;
         virtual void playButtonClicked(bool shouldPlay) = 0;
         virtual void shouldLoopToggled(bool shouldLoop) = 0;
+        virtual void exportButtonClicked() = 0;
     };
 
     ButtonGroupForWavFileProcessing()
@@ -186,10 +233,12 @@ public:
         addAndMakeVisible(openFileBrowserButton);
         addAndMakeVisible(playWavFile);
         addAndMakeVisible(loopButton);
+        addAndMakeVisible(exportButton);
         
         openFileBrowserButton.addListener(this);
         playWavFile.addListener(this);
         loopButton.addListener(this);
+        exportButton.addListener(this);
     }
     
     ~ButtonGroupForWavFileProcessing()
@@ -197,6 +246,7 @@ public:
         openFileBrowserButton.removeListener(this);
         playWavFile.removeListener(this);
         loopButton.removeListener(this);
+        exportButton.removeListener(this);
     }
     
     void resized() override
@@ -204,9 +254,9 @@ public:
         auto bounds = getLocalBounds();
             auto buttonHeight = bounds.getHeight() - 10; // slightly smaller than container height
 
-        // make buttons take up approximately 25-30% of the width each
+        // make buttons take up approximately 20% of the width each
         // this leaves room for spacing between them
-        int buttonWidth = bounds.getWidth() / 4;
+        int buttonWidth = bounds.getWidth() / 5;
     
         juce::FlexBox flex;
         flex.flexDirection = juce::FlexBox::Direction::row;
@@ -219,6 +269,8 @@ public:
                   
         flex.items.add(juce::FlexItem(loopButton).withWidth(buttonWidth).withHeight(buttonHeight));
 
+        flex.items.add(juce::FlexItem(exportButton).withWidth(buttonWidth).withHeight(buttonHeight));
+
         flex.performLayout(bounds);
     }
     void setListener(Listener* newListener) { listener = newListener; }
@@ -238,6 +290,10 @@ public:
         {
             listener->shouldLoopToggled(loopButton.getToggleState());
         }
+        else if(button == &exportButton)
+        {
+            listener->exportButtonClicked();
+        }
     }
     
     void updatePlayButtonText(bool isPlaying)
@@ -248,6 +304,7 @@ public:
     juce::TextButton openFileBrowserButton { "Load a WAV file" };
     juce::TextButton playWavFile { "Play" };
     juce::ToggleButton loopButton { "Loop File" };
+    juce::TextButton exportButton { "Export" };
     
 private:
     Listener* listener = nullptr;
@@ -258,145 +315,194 @@ private:
 class Convolution
 {
 public:
-    Convolution()
-    {
-        audioFormatManagerForIR->registerBasicFormats();
-    }
-    /**
-        when you use smart pointers for your member variables
-        the default destructor will properly clean up those resources by automatically
-        calling the destructors of all member variables when a Convolution object is destroyed
-     */
-    ~Convolution() = default;
+    Convolution() = default;
     
-    void loadImpulseResponse(const juce::File& impulseResponseFile) // can be used later for loading custom IR samples
+    /**
+        shares an impulse response that was loaded through an ImpulseResponseLibrary,
+        nothing is copied. if the convolution has been prepared the streaming state
+        is rebuilt straight away, so don't call this while the audio thread is processing.
+    */
+    void setImpulseResponse(ImpulseResponse::Ptr newImpulseResponse)
     {
-        audioFormatReaderForIR.reset(audioFormatManagerForIR->createReaderFor(impulseResponseFile));
-        if(audioFormatReaderForIR != nullptr)
-        {
-            const int numberOfChannels = audioFormatReaderForIR->numChannels;
-            const int numberOfSamples = static_cast<int>(audioFormatReaderForIR->lengthInSamples);
-            
-            impulseResponseBuffer.setSize(numberOfChannels, numberOfSamples);
-            
-            audioFormatReaderForIR->read(&impulseResponseBuffer, 0, numberOfSamples, 0, true, true);
-            
-            readerSourceForIR = std::make_unique<juce::AudioFormatReaderSource>(audioFormatReaderForIR.get(), false);
-            
-            impulseResponseLength = numberOfSamples;
-        }
+        impulseResponse = newImpulseResponse;
+        rebuildChannelConvolvers();
     }
-        
+    
+    ImpulseResponse::Ptr getImpulseResponse() const { return impulseResponse; }
+    
     /**
-        in c++ const void* data represents a pointer to data of an unspecified type
-        the juce BinaryData system itself uses void* for all its resources.
+        sets up the streaming state for blocks of up to maximumBlockSize samples at sampleRate,
+        which picks the autotuner's measurements for that rate.
+        the partition size is the next power of two, which gives an FFT of twice that size.
+        
+        with shouldRebufferToPartitionSize the input is re-blocked so the engine always sees
+        whole partitions, whatever sizes process is called with. that costs
+        getLatencyInSamples() of delay, so it is meant for the real-time path, offline
+        renders feed large blocks anyway and stay latency free. when maximumBlockSize
+        already is the partition size there is nothing to re-block and no latency is added.
     */
-    void loadImpulseResponseFromBinaryDataInAssets(const void* data, size_t dataSize)
+    void prepare(double sampleRate, int maximumBlockSize, int numberOfChannels, bool shouldRebufferToPartitionSize = false)
     {
-        auto inputStream = std::make_unique<juce::MemoryInputStream>(data, dataSize, false);
-            
-        audioFormatReaderForIR.reset(audioFormatManagerForIR->createReaderFor(std::move(inputStream)));
-        if(audioFormatReaderForIR != nullptr)
-        {
-            const int numberOfChannels = audioFormatReaderForIR->numChannels;
-            const int numberOfSamples = static_cast<int>(audioFormatReaderForIR->lengthInSamples);
-            impulseResponseBuffer.setSize(numberOfChannels, numberOfSamples);
-                
-            audioFormatReaderForIR->read(&impulseResponseBuffer, 0, numberOfSamples, 0, true, true);
-                
-            readerSourceForIR = std::make_unique<juce::AudioFormatReaderSource>(audioFormatReaderForIR.get(), false);
-                
-            impulseResponseLength = numberOfSamples;
-        }
+        preparedSampleRate = sampleRate;
+        partitionSize = juce::nextPowerOfTwo(juce::jmax(minimumPartitionSize, maximumBlockSize));
+        numberOfPreparedChannels = numberOfChannels;
+        isRebuffering = shouldRebufferToPartitionSize && maximumBlockSize != partitionSize;
+        
+        if(isRebuffering)
+            blockSizeAdapter.prepare(partitionSize, numberOfChannels);
+        
+        rebuildChannelConvolvers();
     }
     
+    // delay added by re-blocking, constant for as long as the convolution stays prepared
+    int getLatencyInSamples() const { return isRebuffering ? blockSizeAdapter.getLatencyInSamples() : 0; }
+    
+    // the block size the engine is fed with, 0 until prepare has been called
+    int getPartitionSize() const { return partitionSize; }
+    
     void process(juce::AudioBuffer<float>& buffer)
     {
-        if(impulseResponseLength == 0)
+        if(impulseResponse == nullptr || channelConvolvers.isEmpty())
+        {
+            processDry(buffer);
             return;
+        }
         
-        const int numberOfChannels = buffer.getNumChannels();
+        // channels beyond the prepared ones are left untouched
+        const int numberOfChannels = juce::jmin(buffer.getNumChannels(), channelConvolvers.size());
         const int numberOfSamples = buffer.getNumSamples();
-        
-        // create a temporary buffer for the convolution output
-        juce::AudioBuffer<float> tempBuffer(numberOfChannels, numberOfSamples);
-        tempBuffer.clear();
-        
-        // normalization factor to prevent clipping
-        const float normalizationFactor = 0.1f;
-        
-        // use a shorter portion of the impulse response for real-time processing
-        // This is a compromise for educational purposes
-        const int usableIRLength = juce::jmin(4096, impulseResponseLength);
-        
-        // making sure the outout buffer is large enough
-        if(outputBuffer.getNumChannels() < numberOfChannels || outputBuffer.getNumSamples() < numberOfSamples + impulseResponseLength - 1)
+
+        // the impulse responses are normalized to unit energy when they are loaded, so no extra gain is applied here
+        // y[n] = sum(x[k] * h[n-k]), computed as products of partition spectra
+        if(isRebuffering)
         {
-            outputBuffer.setSize(numberOfChannels, numberOfSamples + impulseResponseLength - 1);
+            blockSizeAdapter.process(buffer, numberOfChannels, [this](int channel, const float* input, float* output) {
+                channelConvolvers.getUnchecked(channel)->process(input, output, partitionSize);
+            });
         }
-        outputBuffer.clear();
-
-        for(int channel = 0; channel < numberOfChannels; ++channel)
+        else
         {
-            const float* inputData = buffer.getReadPointer(channel);
-            float* outputData = outputBuffer.getWritePointer(channel);
-            
-            const int impulseResponseChannel = std::min(channel, impulseResponseBuffer.getNumChannels() - 1);
-            const float* impulseResponseData = impulseResponseBuffer.getReadPointer(impulseResponseChannel);
-            
-            // main algo implement time domain convolution
-            // y[n] = sum(x[k] * h[n-k])
-            for(int n = 0; n < numberOfSamples + impulseResponseLength - 1; ++n)
+            for(int channel = 0; channel < numberOfChannels; ++channel)
             {
-                for(int k = 0; k < usableIRLength; ++k)
-                {
-                    // making sure we are not accessing out of bounds on input
-                    if(n - k >= 0 && n - k < numberOfSamples)
-                    {
-                        outputData[n] += inputData[n - k] * impulseResponseData[k] * normalizationFactor;
-                    }
-                    else
-                    {
-                        // for simplicity, we're ignoring this in this example
-                        break;
-                    }
-                }
+                float* channelData = buffer.getWritePointer(channel);
+                channelConvolvers.getUnchecked(channel)->process(channelData, channelData, numberOfSamples);
             }
-            buffer.copyFrom(channel, 0, outputBuffer, channel, 0, numberOfSamples);
-            if (numberOfChannels > 1)
-                buffer.copyFrom(1, 0, tempBuffer, 1, 0, numberOfSamples);
         }
+    }
+
+    /**
+        passes the buffer through unconvolved but delayed by getLatencyInSamples(), so the
+        latency reported to the host holds whether the convolution is switched on or not.
+    */
+    void processDry(juce::AudioBuffer<float>& buffer)
+    {
+        if(! isRebuffering)
+            return;
         
+        const int blockSize = partitionSize;
+        blockSizeAdapter.process(buffer, juce::jmin(buffer.getNumChannels(), numberOfPreparedChannels),
+                                 [blockSize](int, const float* input, float* output) {
+            juce::FloatVectorOperations::copy(output, input, blockSize);
+        });
     }
 
-    int getImpulseResponseLength() const { return impulseResponseLength; }
+    int getImpulseResponseLength() const { return impulseResponse != nullptr ? impulseResponse->getLength() : 0; }
+    
+    // number of samples the output keeps ringing after the input has stopped
+    int getTailLengthInSamples() const { return juce::jmax(0, getImpulseResponseLength() - 1); }
 
-    float getFirstSampleValue() const
+    /**
+        switches to the engine the wisdom now recommends, for when the autotuner has finished
+        while the convolution is running. the new convolvers are built on the calling thread
+        and only swapped in while holding processLock, which must be the lock process is
+        called under. the new convolvers start without history, so the tail ringing at that
+        moment is cut off. returns false if the engine stays the same.
+    */
+    bool updateEngineConfiguration(const juce::CriticalSection& processLock)
     {
-        if (impulseResponseBuffer.getNumSamples() > 0)
-            return impulseResponseBuffer.getSample(0, 0);
-        return 0.0f;
+        if(impulseResponse == nullptr || partitionSize == 0)
+            return false;
+        
+        const auto newConfiguration = wisdom->getConfiguration(*impulseResponse, partitionSize, preparedSampleRate);
+        if(newConfiguration == engineConfiguration)
+            return false;
+        
+        juce::OwnedArray<ChannelConvolver> newConvolvers;
+        createChannelConvolvers(newConfiguration, newConvolvers);
+        
+        {
+            const juce::ScopedLock lock(processLock);
+            channelConvolvers.swapWith(newConvolvers);
+            engineConfiguration = newConfiguration;
+        }
+        
+        // the old convolvers are freed here, outside the lock
+        return true;
     }
     
     private:
-        std::unique_ptr<juce::AudioFormatManager> audioFormatManagerForIR = std::make_unique<juce::AudioFormatManager>();
-        std::unique_ptr<juce::AudioFormatReader> audioFormatReaderForIR;
-        std::unique_ptr<juce::AudioFormatReaderSource> readerSourceForIR;
-        juce::AudioBuffer<float> impulseResponseBuffer;
-        juce::AudioBuffer<float> outputBuffer;
-        int impulseResponseLength = 0;
+        void rebuildChannelConvolvers()
+        {
+            channelConvolvers.clear();
+            if(isRebuffering)
+                blockSizeAdapter.reset();
+            
+            if(impulseResponse == nullptr || partitionSize == 0)
+                return;
+            
+            // the autotuner's measured winner if there is one, otherwise sparse responses
+            // only pay for their echoes and everything else goes through the partitioned FFT
+            engineConfiguration = wisdom->getConfiguration(*impulseResponse, partitionSize, preparedSampleRate);
+            createChannelConvolvers(engineConfiguration, channelConvolvers);
+        }
+        
+        // the spectra are shared, only the per channel streaming state is created here
+        void createChannelConvolvers(const EngineConfiguration& configuration, juce::OwnedArray<ChannelConvolver>& destination) const
+        {
+            for(int channel = 0; channel < numberOfPreparedChannels; ++channel)
+            {
+                const int impulseResponseChannel = std::min(channel, impulseResponse->getNumChannels() - 1);
+                destination.add(createChannelConvolver(*impulseResponse, impulseResponseChannel, partitionSize, configuration).release());
+            }
+        }
+        
+        static constexpr int minimumPartitionSize = 64;
+        
+        juce::SharedResourcePointer<ConvolutionWisdom> wisdom;
+        EngineConfiguration engineConfiguration;
+        
+        ImpulseResponse::Ptr impulseResponse;
+        juce::OwnedArray<ChannelConvolver> channelConvolvers;
+        BlockSizeAdapter blockSizeAdapter;
+        int partitionSize = 0;
+        int numberOfPreparedChannels = 0;
+        double preparedSampleRate = 0.0;
+        bool isRebuffering = false;
 };
 
 class ConvolutionProcessor : public juce::AudioProcessor
 {
 public:
-    ConvolutionProcessor(Convolution& convolutionToUse) : convolution(convolutionToUse)
+    ConvolutionProcessor()
     {
         audioFormatManager.registerBasicFormats();
     }
     
+    ~ConvolutionProcessor() override
+    {
+        // let a running preview job bail out at its next slice
+        ++(*previewGeneration);
+        previewPool.removeAllJobs(true, 5000);
+    }
+    
     void prepareToPlay(double sampleRate, int maximumSamplesPerBlock) override
     {
+        // the device may deliver any block size up to the maximum, so let the convolution
+        // re-block to its partition size and tell the host about the resulting delay,
+        // which stays 0 when the device already delivers whole partitions
+        convolution.prepare(sampleRate, maximumSamplesPerBlock, juce::jmax(2, getTotalNumOutputChannels()), true);
+        setLatencySamples(convolution.getLatencyInSamples());
+        
         if(audioSource != nullptr)
         {
             audioSource->prepareToPlay(maximumSamplesPerBlock, sampleRate);
@@ -429,32 +535,105 @@ public:
                 // make sure the convolution doesn't change the buffer dimensions
                 convolution.process(buffer);
             }
+            else
+            {
+                // the dry signal goes through the same delay, so switching doesn't shift the audio
+                convolution.processDry(buffer);
+            }
         }
         juce::ignoreUnused(midiMessages);
     }
     
-    void createConvolvedPreview(const juce::File& sourceFile, std::function<void(const juce::AudioBuffer<float>&, double)> callback)
+    /**
+        renders the preview progressively on a background thread. a coarse envelope of the
+        convolved file is delivered as soon as the first slice has been read and is updated
+        while the rest is read. the full resolution render follows once it is done.
+        callback is called on the message thread for each of them, isFinal is false for the
+        coarse ones. starting a new preview abandons the previous one.
+    */
+    void createConvolvedPreview(const juce::File& sourceFile, std::function<void(std::shared_ptr<const juce::AudioBuffer<float>>, double, bool)> callback)
     {
-        // Load the source file
-        std::unique_ptr<juce::AudioFormatReader> reader(audioFormatManager.createReaderFor(sourceFile));
+        const int generation = ++(*previewGeneration);
+        auto generationCounter = previewGeneration;
+        auto impulseResponse = convolution.getImpulseResponse();
+        const bool shouldConvolve = isConvolutionEnabled && impulseResponse != nullptr;
         
-        if (reader != nullptr)
-        {
+        auto isOutdated = [generationCounter, generation] { return generationCounter->load() != generation; };
+        
+        auto deliver = [callback, isOutdated](std::shared_ptr<juce::AudioBuffer<float>> buffer, double sampleRate, bool isFinal) {
+            juce::MessageManager::callAsync([callback, isOutdated, buffer, sampleRate, isFinal] {
+                if (! isOutdated())
+                    callback(buffer, sampleRate, isFinal);
+            });
+        };
+        
+        previewPool.addJob([this, sourceFile, impulseResponse, shouldConvolve, isOutdated, deliver] {
+            // Load the source file
+            std::unique_ptr<juce::AudioFormatReader> reader(audioFormatManager.createReaderFor(sourceFile));
+            
+            if (reader == nullptr || isOutdated())
+                return;
+            
             // Create a buffer large enough for the whole file
-            juce::AudioBuffer<float> fileBuffer(reader->numChannels, static_cast<int>(reader->lengthInSamples));
+            const int numberOfSamples = static_cast<int>(reader->lengthInSamples);
+            const int numberOfChannels = static_cast<int>(reader->numChannels);
+            auto fileBuffer = std::make_shared<juce::AudioBuffer<float>>(numberOfChannels, numberOfSamples);
+            
+            std::unique_ptr<CoarseEnvelope> coarseEnvelope;
+            if (shouldConvolve)
+                coarseEnvelope = std::make_unique<CoarseEnvelope>(*impulseResponse, numberOfChannels, numberOfSamples);
             
-            // Read the entire file into the buffer
-            reader->read(&fileBuffer, 0, static_cast<int>(reader->lengthInSamples), 0, true, true);
+            // read the file in slices and grow the coarse envelope as they come in, so the first
+            // approximation shows up after one slice instead of after decoding the whole file
+            auto lastDeliveryTime = juce::Time::getMillisecondCounter();
             
-            // Apply convolution if enabled
-            if (isConvolutionEnabled)
+            for (int start = 0; start < numberOfSamples; start += previewSliceSize)
             {
-                convolution.process(fileBuffer);
+                if (isOutdated())
+                    return;
+                
+                const int numSamplesToRead = juce::jmin(previewSliceSize, numberOfSamples - start);
+                reader->read(fileBuffer.get(), start, numSamplesToRead, start, true, true);
+                
+                if (coarseEnvelope == nullptr)
+                    continue;
+                
+                coarseEnvelope->addInput(*fileBuffer, start, numSamplesToRead);
+                
+                const auto now = juce::Time::getMillisecondCounter();
+                const bool isLastSlice = start + numSamplesToRead >= numberOfSamples;
+                if (start == 0 || isLastSlice || now - lastDeliveryTime >= coarsePreviewInterval)
+                {
+                    deliver(std::make_shared<juce::AudioBuffer<float>>(coarseEnvelope->getAmplitude()),
+                            reader->sampleRate / coarsePreviewDecimation, false);
+                    lastDeliveryTime = now;
+                }
             }
             
-            // Call the callback with the processed buffer
-            callback(fileBuffer, reader->sampleRate);
-        }
+            if (! shouldConvolve)
+            {
+                deliver(fileBuffer, reader->sampleRate, true);
+                return;
+            }
+            
+            // the preview gets its own streaming state but shares the impulse response with playback
+            Convolution previewConvolution;
+            previewConvolution.setImpulseResponse(impulseResponse);
+            previewConvolution.prepare(reader->sampleRate, previewBlockSize, fileBuffer->getNumChannels());
+            
+            // convolve in slices so a newer preview doesn't have to wait for this one to finish
+            for (int start = 0; start < numberOfSamples; start += previewSliceSize)
+            {
+                if (isOutdated())
+                    return;
+                
+                juce::AudioBuffer<float> slice(fileBuffer->getArrayOfWritePointers(), fileBuffer->getNumChannels(),
+                                               start, juce::jmin(previewSliceSize, numberOfSamples - start));
+                previewConvolution.process(slice);
+            }
+            
+            deliver(fileBuffer, reader->sampleRate, true);
+        });
     }
     
     // required overrides for AudioProcessor
@@ -473,13 +652,404 @@ public:
     void setStateInformation(const void*, int) override {}
 
     void setConvolutionEnabled(bool shouldBeEnabled) { isConvolutionEnabled.store(shouldBeEnabled); }
+    bool getConvolutionEnabled() const { return isConvolutionEnabled.load(); }
     void setAudioSource(juce::AudioSource* source) { audioSource = source; }
+    
+    // detach the processor from the player before swapping the impulse response
+    void setImpulseResponse(ImpulseResponse::Ptr newImpulseResponse) { convolution.setImpulseResponse(newImpulseResponse); }
+    ImpulseResponse::Ptr getImpulseResponse() const { return convolution.getImpulseResponse(); }
+    int getConvolutionPartitionSize() const { return convolution.getPartitionSize(); }
+    
+    /**
+        picks up an engine the autotuner has just measured without stopping playback.
+        the player holds the callback lock around processBlock, so the swap waits for the
+        current block instead of detaching the processor and releasing the audio source.
+    */
+    void updateConvolutionEngine() { convolution.updateEngineConfiguration(getCallbackLock()); }
 
 private:
-    Convolution& convolution;
+    /**
+        approximates the convolved file at 1 / coarsePreviewDecimation of the sample rate.
+        for noise-like responses the output power is roughly the input power convolved with
+        the response's energy, so both are reduced to per-frame energies and convolved
+        directly. the input can be added a slice at a time while the file is being read.
+    */
+    class CoarseEnvelope
+    {
+    public:
+        CoarseEnvelope(const ImpulseResponse& impulseResponse, int numberOfChannels, int numberOfSamples)
+            : numFrames((numberOfSamples + coarsePreviewDecimation - 1) / coarsePreviewDecimation),
+              numImpulseResponseFrames((impulseResponse.getLength() + coarsePreviewDecimation - 1) / coarsePreviewDecimation),
+              power(numberOfChannels, numFrames),
+              impulseResponseEnergy(numberOfChannels, numImpulseResponseFrames)
+        {
+            power.clear();
+            
+            for (int channel = 0; channel < numberOfChannels; ++channel)
+            {
+                const int impulseResponseChannel = juce::jmin(channel, impulseResponse.getNumChannels() - 1);
+                const float* data = impulseResponse.getReadPointer(impulseResponseChannel);
+                
+                for (int frame = 0; frame < numImpulseResponseFrames; ++frame)
+                    impulseResponseEnergy.setSample(channel, frame, getFrameEnergy(data, impulseResponse.getLength(), frame));
+            }
+        }
+        
+        // start must be a multiple of coarsePreviewDecimation
+        void addInput(const juce::AudioBuffer<float>& input, int start, int numSamples)
+        {
+            jassert(start % coarsePreviewDecimation == 0);
+            const int firstFrame = start / coarsePreviewDecimation;
+            const int endFrame = juce::jmin(numFrames, (start + numSamples + coarsePreviewDecimation - 1) / coarsePreviewDecimation);
+            
+            for (int channel = 0; channel < power.getNumChannels(); ++channel)
+            {
+                const float* inputData = input.getReadPointer(channel);
+                const float* energies = impulseResponseEnergy.getReadPointer(channel);
+                float* powerData = power.getWritePointer(channel);
+                
+                for (int frame = firstFrame; frame < endFrame; ++frame)
+                {
+                    // the input energy is summed over a frame, it has to be the mean power
+                    const float meanPower = getFrameEnergy(inputData, start + numSamples, frame) / static_cast<float>(coarsePreviewDecimation);
+                    if (meanPower > 0.0f)
+                        juce::FloatVectorOperations::addWithMultiply(powerData + frame, energies, meanPower, juce::jmin(numImpulseResponseFrames, numFrames - frame));
+                }
+            }
+        }
+        
+        // the amplitude so far, with an alternating sign so the thumbnail draws a band
+        juce::AudioBuffer<float> getAmplitude() const
+        {
+            juce::AudioBuffer<float> amplitude(power.getNumChannels(), numFrames);
+            
+            for (int channel = 0; channel < power.getNumChannels(); ++channel)
+            {
+                const float* powerData = power.getReadPointer(channel);
+                float* amplitudeData = amplitude.getWritePointer(channel);
+                
+                for (int frame = 0; frame < numFrames; ++frame)
+                    amplitudeData[frame] = std::sqrt(juce::jmax(0.0f, powerData[frame])) * ((frame & 1) == 0 ? 1.0f : -1.0f);
+            }
+            
+            return amplitude;
+        }
+        
+    private:
+        static float getFrameEnergy(const float* data, int numSamples, int frame)
+        {
+            const int start = frame * coarsePreviewDecimation;
+            const int end = juce::jmin(numSamples, start + coarsePreviewDecimation);
+            float energy = 0.0f;
+            
+            for (int sample = start; sample < end; ++sample)
+                energy += data[sample] * data[sample];
+            
+            return energy;
+        }
+        
+        const int numFrames;
+        const int numImpulseResponseFrames;
+        juce::AudioBuffer<float> power;
+        juce::AudioBuffer<float> impulseResponseEnergy;
+    };
+    
+    // offline rendering isn't bound by a callback size, so it uses larger partitions
+    static constexpr int previewBlockSize = 4096;
+    static constexpr int previewSliceSize = 65536;
+    static constexpr int coarsePreviewDecimation = 64;
+    // milliseconds between updates of the coarse preview while the file is being read
+    static constexpr juce::uint32 coarsePreviewInterval = 100;
+    
+    Convolution convolution;
     juce::AudioSource* audioSource = nullptr;
     std::atomic<bool> isConvolutionEnabled { false };
     juce::AudioFormatManager audioFormatManager;
+    
+    // shared with the preview jobs and their callbacks, which may outlive a single preview
+    std::shared_ptr<std::atomic<int>> previewGeneration = std::make_shared<std::atomic<int>>(0);
+    juce::ThreadPool previewPool { 1 };
+};
+
+/**
+    renders a file through its own convolution state and streams the result to disk
+
+    a render thread reads and convolves the file block by block and pushes the blocks into
+    a bounded queue, a writer thread drains that queue into the encoder. encoding and disk
+    I/O therefore overlap with the convolution instead of waiting for the whole file.
+*/
+class ConvolvedAudioExporter
+{
+public:
+    enum class Format
+    {
+        wav24Bit,
+        wav32BitFloat,
+        flac24Bit
+    };
+    
+    struct Result
+    {
+        bool wasSuccessful = false;
+        juce::String errorMessage;
+        double audioLengthSeconds = 0.0;
+        double renderTimeSeconds = 0.0;
+        
+        // how many seconds of audio were exported per second of wall clock time
+        double getRealtimeMultiple() const { return renderTimeSeconds > 0.0 ? audioLengthSeconds / renderTimeSeconds : 0.0; }
+    };
+    
+    ConvolvedAudioExporter(juce::AudioFormatManager& formatManagerToUse) : formatManager(formatManagerToUse) {}
+    
+    ~ConvolvedAudioExporter()
+    {
+        cancel();
+    }
+    
+    static juce::String getFileExtension(Format format)
+    {
+        return format == Format::flac24Bit ? ".flac" : ".wav";
+    }
+    
+    /**
+        starts rendering sourceFile into destinationFile on the background threads.
+        onFinished is called on the message thread once the last block has been written.
+    */
+    juce::Result startExport(const juce::File& sourceFile, const juce::File& destinationFile, Format format,
+                             ImpulseResponse::Ptr impulseResponse, bool shouldConvolve,
+                             std::function<void(const Result&)> onFinished)
+    {
+        if(isExporting())
+            return juce::Result::fail("An export is already running");
+        
+        cancel();
+        
+        reader.reset(formatManager.createReaderFor(sourceFile));
+        if(reader == nullptr)
+            return juce::Result::fail("Could not read " + sourceFile.getFileName());
+        
+        auto* audioFormat = formatManager.findFormatForFileExtension(getFileExtension(format));
+        if(audioFormat == nullptr)
+            return juce::Result::fail("No encoder available for " + getFileExtension(format));
+        
+        destinationFile.deleteFile();
+        auto outputStream = std::make_unique<juce::FileOutputStream>(destinationFile);
+        if(outputStream->failedToOpen())
+            return juce::Result::fail("Could not write to " + destinationFile.getFullPathName());
+        
+        const int bitDepth = format == Format::wav32BitFloat ? 32 : 24;
+        writer.reset(audioFormat->createWriterFor(outputStream.get(),
+                                                  reader->sampleRate,
+                                                  reader->numChannels,
+                                                  bitDepth,
+                                                  {}, // metadata
+                                                  0 // quality option
+                                                  ));
+        if(writer == nullptr)
+            return juce::Result::fail("The encoder does not support this sample rate or channel count");
+        
+        // the writer now owns the stream
+        outputStream.release();
+        
+        isConvolving = shouldConvolve && impulseResponse != nullptr;
+        convolution.setImpulseResponse(impulseResponse);
+        convolution.prepare(reader->sampleRate, blockSize, static_cast<int>(reader->numChannels));
+        
+        // let the reverb ring out after the end of the source file
+        totalNumSamples = reader->lengthInSamples + (isConvolving ? convolution.getTailLengthInSamples() : 0);
+        numSamplesRendered = 0;
+        numSamplesWritten = 0;
+        renderFinished = false;
+        renderFailed = false;
+        exportedFile = destinationFile;
+        finishedCallback = std::move(onFinished);
+        
+        queue.reset();
+        for(auto& block : blocks)
+            block.setSize(static_cast<int>(reader->numChannels), blockSize);
+        
+        startTime = juce::Time::getMillisecondCounterHiRes();
+        writerThread.startThread();
+        renderThread.startThread();
+        return juce::Result::ok();
+    }
+    
+    bool isExporting() const { return renderThread.isThreadRunning() || writerThread.isThreadRunning(); }
+    
+    // stops both threads and deletes a partially written file
+    void cancel()
+    {
+        if(! isExporting() && writer == nullptr)
+            return;
+        
+        renderThread.signalThreadShouldExit();
+        writerThread.signalThreadShouldExit();
+        spaceAvailable.signal();
+        dataAvailable.signal();
+        renderThread.stopThread(2000);
+        writerThread.stopThread(2000);
+        
+        if(writer != nullptr)
+        {
+            writer.reset();
+            exportedFile.deleteFile();
+        }
+        reader.reset();
+    }
+    
+private:
+    // number of blocks the render thread may run ahead of the writer
+    static constexpr int numQueuedBlocks = 16;
+    static constexpr int blockSize = 8192;
+    
+    class RenderThread : public juce::Thread
+    {
+    public:
+        RenderThread(ConvolvedAudioExporter& ownerToUse) : juce::Thread("Convolution export render"), owner(ownerToUse) {}
+        void run() override { owner.renderBlocks(); }
+    private:
+        ConvolvedAudioExporter& owner;
+    };
+    
+    class WriterThread : public juce::Thread
+    {
+    public:
+        WriterThread(ConvolvedAudioExporter& ownerToUse) : juce::Thread("Convolution export writer"), owner(ownerToUse) {}
+        void run() override { owner.writeBlocks(); }
+    private:
+        ConvolvedAudioExporter& owner;
+    };
+    
+    void renderBlocks()
+    {
+        while(numSamplesRendered < totalNumSamples && ! renderThread.threadShouldExit())
+        {
+            // wait for the writer to hand back a block when the queue is full
+            if(queue.getFreeSpace() == 0)
+            {
+                spaceAvailable.wait(50);
+                continue;
+            }
+            
+            int start1, size1, start2, size2;
+            queue.prepareToWrite(1, start1, size1, start2, size2);
+            auto& block = blocks[static_cast<size_t>(start1)];
+            
+            const int numSamples = static_cast<int>(juce::jmin(static_cast<juce::int64>(blockSize), totalNumSamples - numSamplesRendered));
+            block.setSize(block.getNumChannels(), numSamples, false, false, true);
+            
+            // reading past the end of the source fills the block with silence, which flushes the tail
+            if(! reader->read(&block, 0, numSamples, numSamplesRendered, true, true))
+            {
+                renderFailed = true;
+                break;
+            }
+            
+            if(isConvolving)
+                convolution.process(block);
+            
+            queue.finishedWrite(1);
+            numSamplesRendered += numSamples;
+            dataAvailable.signal();
+        }
+        
+        renderFinished = true;
+        dataAvailable.signal();
+    }
+    
+    void writeBlocks()
+    {
+        bool writeFailed = false;
+        
+        while(! writerThread.threadShouldExit())
+        {
+            if(queue.getNumReady() == 0)
+            {
+                // the render thread may push its last block between the check above and
+                // setting the flag, so the queue has to be checked again once the flag is seen
+                if(renderFinished)
+                {
+                    if(queue.getNumReady() == 0)
+                        break;
+                    
+                    continue;
+                }
+                
+                dataAvailable.wait(50);
+                continue;
+            }
+            
+            int start1, size1, start2, size2;
+            queue.prepareToRead(1, start1, size1, start2, size2);
+            const auto& block = blocks[static_cast<size_t>(start1)];
+            
+            if(writer->writeFromAudioSampleBuffer(block, 0, block.getNumSamples()))
+                numSamplesWritten += block.getNumSamples();
+            else
+                writeFailed = true;
+            
+            queue.finishedRead(1);
+            spaceAvailable.signal();
+            
+            if(writeFailed)
+            {
+                // nothing will drain the queue any more, so the render thread mustn't wait for space
+                renderThread.signalThreadShouldExit();
+                spaceAvailable.signal();
+                break;
+            }
+        }
+        
+        if(writerThread.threadShouldExit())
+            return;
+        
+        // destroying the writer flushes the encoder and closes the file
+        writer.reset();
+        
+        Result result;
+        result.wasSuccessful = ! (writeFailed || renderFailed);
+        result.errorMessage = writeFailed ? "Writing to disk failed" : (renderFailed ? "Reading the source file failed" : juce::String());
+        result.audioLengthSeconds = static_cast<double>(numSamplesWritten.load()) / reader->sampleRate;
+        result.renderTimeSeconds = (juce::Time::getMillisecondCounterHiRes() - startTime) / 1000.0;
+        
+        if(! result.wasSuccessful)
+            exportedFile.deleteFile();
+        
+        DBG("Exported " + juce::String(result.audioLengthSeconds, 2) + " s in " + juce::String(result.renderTimeSeconds, 2)
+            + " s (" + juce::String(result.getRealtimeMultiple(), 1) + "x real time)");
+        
+        if(finishedCallback != nullptr)
+        {
+            juce::MessageManager::callAsync([callback = finishedCallback, result] { callback(result); });
+        }
+    }
+    
+    juce::AudioFormatManager& formatManager;
+    std::unique_ptr<juce::AudioFormatReader> reader;
+    std::unique_ptr<juce::AudioFormatWriter> writer;
+    
+    // the exporter shares the impulse response but keeps its own streaming state so playback is never disturbed
+    Convolution convolution;
+    bool isConvolving = false;
+    
+    // the bounded queue between the render and writer threads
+    juce::AbstractFifo queue { numQueuedBlocks };
+    std::array<juce::AudioBuffer<float>, numQueuedBlocks> blocks;
+    juce::WaitableEvent spaceAvailable, dataAvailable;
+    
+    juce::int64 totalNumSamples = 0;
+    juce::int64 numSamplesRendered = 0;
+    std::atomic<juce::int64> numSamplesWritten { 0 };
+    std::atomic<bool> renderFinished { false };
+    std::atomic<bool> renderFailed { false };
+    double startTime = 0.0;
+    juce::File exportedFile;
+    std::function<void(const Result&)> finishedCallback;
+    
+    RenderThread renderThread { *this };
+    WriterThread writerThread { *this };
+    
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (ConvolvedAudioExporter)
 };
 
 //==============================================================================
@@ -487,7 +1057,7 @@ private:
     This component lives inside our window, and this is where you should put all
     your controls and content.
 */
-class MainComponent  : public juce::Component, private juce::ComboBox::Listener, private ButtonGroupForWavFileProcessing::Listener
+class MainComponent  : public juce::Component, private juce::ComboBox::Listener, private ButtonGroupForWavFileProcessing::Listener, private juce::Timer
 {
 public:
     //==============================================================================
@@ -501,26 +1071,39 @@ public:
     void loadWavFileButtonClicked() override;
     void playButtonClicked(bool shouldPlay) override;
     void shouldLoopToggled(bool shouldLoop) override;
+    void exportButtonClicked() override;
     void comboBoxChanged(juce::ComboBox* comboBoxThatHasChanged) override;
+    void timerCallback() override;
 
 private:
     //==============================================================================
     juce::String convolutionComboboxText;
     
-    // AudioFormatManager → AudioFormatReader → AudioTransportSource → AudioSourcePlayer → AudioDeviceManager → Audio Hardware
+    // AudioFormatManager → AudioFormatReader → ReadAheadAudioSource → AudioTransportSource → AudioSourcePlayer → AudioDeviceManager → Audio Hardware
     std::unique_ptr<juce::AudioFormatManager> audioFormatManager = std::make_unique<juce::AudioFormatManager>();
     std::unique_ptr<juce::AudioFormatReader> audioFormatReader;
     std::unique_ptr<juce::AudioFormatReaderSource> readerSource;
+    
+    // disk reads happen on this thread so they never eat into the audio callback
+    static constexpr int readAheadBufferSize = 65536; // samples, about 1.5 seconds at 44.1 kHz
+    juce::TimeSliceThread readAheadThread { "Playback read-ahead" };
+    std::unique_ptr<ReadAheadAudioSource> readAheadSource;
     std::unique_ptr<juce::FileChooser> currentFileChooser;
+    std::unique_ptr<juce::FileChooser> exportFileChooser;
     juce::AudioTransportSource transportSource;
     juce::AudioDeviceManager deviceManager;
     juce::AudioProcessorPlayer processorPlayer;
     juce::ComboBox convolutionOptions;
+    juce::ComboBox exportFormatOptions;
+    juce::Label exportStatusLabel;
+    juce::Label readAheadStatusLabel;
     
     AudioWaveFormComponent waveformDisplay;
     ButtonGroupForWavFileProcessing waveFileHandlerButtons;
-    Convolution timeDomainConvolution;
+    ImpulseResponseLibrary impulseResponseLibrary;
+    ConvolutionAutotuner autotuner;
     std::unique_ptr<ConvolutionProcessor> convolutionProcessor;
+    ConvolvedAudioExporter exporter { *audioFormatManager };
 
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (MainComponent)
 };
@@ -0,0 +1,224 @@
+#pragma once
+
+#include <JuceHeader.h>
+
+/**
+    reads a positionable source ahead of the playhead on a TimeSliceThread.
+
+    the audio callback only copies from a circular buffer that the background thread
+    keeps filled, so a slow disk or a network mount never costs the callback any time.
+    when the buffer doesn't hold the requested samples the block is played as silence
+    and counted as an underrun, the counters can be shown in the UI.
+*/
+class ReadAheadAudioSource : public juce::PositionableAudioSource, private juce::TimeSliceClient
+{
+public:
+    ReadAheadAudioSource(juce::PositionableAudioSource& sourceToRead, juce::TimeSliceThread& threadToUse,
+                         int numberOfChannelsToRead, int bufferSizeInSamples)
+        : source(sourceToRead),
+          backgroundThread(threadToUse),
+          numberOfChannels(numberOfChannelsToRead),
+          bufferSize(bufferSizeInSamples)
+    {
+        jassert(bufferSize > 0);
+    }
+
+    ~ReadAheadAudioSource() override
+    {
+        backgroundThread.removeTimeSliceClient(this);
+    }
+
+    void prepareToPlay(int samplesPerBlockExpected, double sampleRate) override
+    {
+        // the background thread must not be filling the buffer while it is resized
+        backgroundThread.removeTimeSliceClient(this);
+
+        source.prepareToPlay(samplesPerBlockExpected, sampleRate);
+
+        // always keep at least a couple of callbacks worth of audio buffered
+        buffer.setSize(numberOfChannels, juce::jmax(bufferSize, samplesPerBlockExpected * 2));
+        buffer.clear();
+        bufferLength = buffer.getNumSamples();
+        {
+            const juce::SpinLock::ScopedLockType lock(bufferRangeLock);
+            bufferValidStart = bufferValidEnd = nextPlayPosition.load();
+        }
+        resetUnderrunCounters();
+
+        backgroundThread.addTimeSliceClient(this);
+    }
+
+    void releaseResources() override
+    {
+        backgroundThread.removeTimeSliceClient(this);
+        bufferLength = 0;
+        buffer.setSize(0, 0);
+        source.releaseResources();
+    }
+
+    void getNextAudioBlock(const juce::AudioSourceChannelInfo& info) override
+    {
+        const juce::int64 playPosition = nextPlayPosition.load();
+        juce::int64 validStart, validEnd;
+        {
+            const juce::SpinLock::ScopedLockType lock(bufferRangeLock);
+            validStart = bufferValidStart;
+            validEnd = bufferValidEnd;
+        }
+
+        // the part of the request that has already been read ahead
+        const juce::int64 availableStart = juce::jlimit(playPosition, playPosition + info.numSamples, validStart);
+        const juce::int64 availableEnd = juce::jlimit(availableStart, playPosition + info.numSamples, validEnd);
+        const int numAvailable = static_cast<int>(availableEnd - availableStart);
+        const int offset = static_cast<int>(availableStart - playPosition);
+
+        if(numAvailable < info.numSamples)
+        {
+            info.clearActiveBufferRegion();
+            ++numUnderruns;
+            numSamplesMissed += info.numSamples - numAvailable;
+        }
+
+        if(numAvailable > 0 && buffer.getNumSamples() > 0)
+        {
+            const int numBufferSamples = buffer.getNumSamples();
+            const int readIndex = static_cast<int>(availableStart % numBufferSamples);
+            const int numBeforeWrap = juce::jmin(numAvailable, numBufferSamples - readIndex);
+
+            for(int channel = 0; channel < info.buffer->getNumChannels(); ++channel)
+            {
+                // a mono file is played on every output channel
+                const int sourceChannel = juce::jmin(channel, numberOfChannels - 1);
+                info.buffer->copyFrom(channel, info.startSample + offset, buffer, sourceChannel, readIndex, numBeforeWrap);
+
+                if(numBeforeWrap < numAvailable)
+                    info.buffer->copyFrom(channel, info.startSample + offset + numBeforeWrap, buffer, sourceChannel, 0, numAvailable - numBeforeWrap);
+            }
+        }
+
+        // don't overwrite a seek that arrived while this block was being copied
+        auto expectedPosition = playPosition;
+        nextPlayPosition.compare_exchange_strong(expectedPosition, playPosition + info.numSamples);
+        backgroundThread.notify();
+    }
+
+    void setNextReadPosition(juce::int64 newPosition) override
+    {
+        nextPlayPosition = newPosition;
+        backgroundThread.notify();
+    }
+
+    juce::int64 getNextReadPosition() const override
+    {
+        const auto position = nextPlayPosition.load();
+        const auto totalLength = source.getTotalLength();
+
+        if(source.isLooping() && totalLength > 0)
+            return position % totalLength;
+
+        return position;
+    }
+
+    juce::int64 getTotalLength() const override { return source.getTotalLength(); }
+    bool isLooping() const override { return source.isLooping(); }
+    void setLooping(bool shouldLoop) override { source.setLooping(shouldLoop); }
+
+    // number of callbacks that had to play silence because the disk couldn't keep up
+    int getNumUnderruns() const noexcept { return numUnderruns.load(); }
+    juce::int64 getNumSamplesMissed() const noexcept { return numSamplesMissed.load(); }
+
+    void resetUnderrunCounters()
+    {
+        numUnderruns = 0;
+        numSamplesMissed = 0;
+    }
+
+    /**
+        how much of the read-ahead buffer currently holds audio that hasn't been played yet.
+        called from the UI, so it only reads the atomic length and never touches the buffer itself.
+    */
+    double getBufferFillLevel() const
+    {
+        const int length = bufferLength.load();
+        if(length == 0)
+            return 0.0;
+
+        const juce::SpinLock::ScopedLockType lock(bufferRangeLock);
+        const auto numBuffered = juce::jmax(static_cast<juce::int64>(0), bufferValidEnd - juce::jmax(bufferValidStart, nextPlayPosition.load()));
+        return juce::jmin(1.0, static_cast<double>(numBuffered) / static_cast<double>(length));
+    }
+
+private:
+    int useTimeSlice() override
+    {
+        // come straight back while there is still something to read
+        return readNextChunk() ? 1 : 50;
+    }
+
+    bool readNextChunk()
+    {
+        const int numBufferSamples = buffer.getNumSamples();
+        if(numBufferSamples == 0)
+            return false;
+
+        juce::int64 sectionStart, sectionEnd;
+        {
+            const juce::SpinLock::ScopedLockType lock(bufferRangeLock);
+            const auto playPosition = nextPlayPosition.load();
+
+            // after a seek nothing in the buffer is of any use
+            if(playPosition < bufferValidStart || playPosition > bufferValidEnd)
+                bufferValidEnd = playPosition;
+
+            // everything before the playhead has been played, so its space can be refilled
+            bufferValidStart = playPosition;
+
+            sectionStart = bufferValidEnd;
+            sectionEnd = juce::jmin(bufferValidStart + numBufferSamples, sectionStart + maximumChunkSize);
+        }
+
+        if(sectionEnd <= sectionStart)
+            return false;
+
+        // the audio thread only reads between bufferValidStart and bufferValidEnd,
+        // so the section after it can be written without holding the lock
+        if(source.getNextReadPosition() != sectionStart)
+            source.setNextReadPosition(sectionStart);
+
+        const int numToRead = static_cast<int>(sectionEnd - sectionStart);
+        const int writeIndex = static_cast<int>(sectionStart % numBufferSamples);
+        const int numBeforeWrap = juce::jmin(numToRead, numBufferSamples - writeIndex);
+
+        source.getNextAudioBlock(juce::AudioSourceChannelInfo(&buffer, writeIndex, numBeforeWrap));
+
+        if(numBeforeWrap < numToRead)
+            source.getNextAudioBlock(juce::AudioSourceChannelInfo(&buffer, 0, numToRead - numBeforeWrap));
+
+        {
+            // a seek that happened meanwhile is picked up by the next time slice
+            const juce::SpinLock::ScopedLockType lock(bufferRangeLock);
+            bufferValidEnd = sectionEnd;
+        }
+        return true;
+    }
+
+    // the most the background thread reads before giving other clients a turn
+    static constexpr int maximumChunkSize = 8192;
+
+    juce::PositionableAudioSource& source;
+    juce::TimeSliceThread& backgroundThread;
+    const int numberOfChannels;
+    const int bufferSize;
+
+    juce::AudioBuffer<float> buffer;
+    // the length of buffer for threads that mustn't look at buffer while it may be resized
+    std::atomic<int> bufferLength { 0 };
+    mutable juce::SpinLock bufferRangeLock;
+    juce::int64 bufferValidStart = 0, bufferValidEnd = 0;
+    std::atomic<juce::int64> nextPlayPosition { 0 };
+
+    std::atomic<int> numUnderruns { 0 };
+    std::atomic<juce::int64> numSamplesMissed { 0 };
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (ReadAheadAudioSource)
+};